@@ -2,21 +2,102 @@
 #include <vector>
 #include <string>
 #include <cstring>
+#include <cstddef>
 #include <cstdlib>
 #include <ctime>
 #include <chrono>
 #include <algorithm>
 #include <cmath>
 #include <sstream>
+#include <fstream>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <map>
+#include <functional>
+#include <cctype>
+#include <deque>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <random>
+#include <unordered_map>
+#include <unordered_set>
+#include <array>
+#include <new>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "slowfish.h"
+
+#ifndef _WIN32
+#include <csignal>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <sched.h>
+#endif
 
 const int BOARD_SQUARES_NUMBER = 120;
 const int MAX_GAME_MOVES = 2048;
 const int MAX_POSITION_MOVES = 256;
 const int MAX_DEPTH = 32;
+const int MAX_MULTI_PV = 64;
+const int CONTINUATION_SIZE = 14 * 64;   // Piece and 64-square destination
+const int HISTORY_MAX = 16384;
+const int HISTORY_BONUS_MAX = 1200;
+const int MAX_QUIETS_TRIED = 64;
+const int QUIET_SCORE_BASE = 3 * HISTORY_MAX;   // Keeps every quiet move's score positive for PickNextMove
+const int CLUSTER_SHARE_DEPTH = 4;
+const int MAX_CACHE_PV = 24;
 const int INFINITE = 30000;
 const int MATE = 29000;
 const int NO_MOVE = 0;
-const int MAX_PV_TABLE_ENTRIES = 65536; // 2^16
+const int DEFAULT_HASH_MB = 1;
+const int DEFAULT_MATE_HASH_MB = 16;
+const uint32_t PN_INFINITE = 1000000000;
+const uint32_t MATE_QUIET_PROOF = 4;
+const int MAX_HASH_MB = 16384;       // 2^32 four-byte entries, as many as a 32-bit position key can index
+const int MAX_MATE_HASH_MB = 16384;
+const int MATE_FALLBACK_DEPTH = 8;  // Depth limit of the normal search that answers a go mate without a mate
+const size_t LARGE_PAGE_SIZE = 2 * 1024 * 1024;
+const size_t PARALLEL_CLEAR_BYTES = 64 * 1024 * 1024;
+const long long MATCH_GRACE_MS = 1000;
+const int PGN_MATE_LOSS = 10000;
+const int DEFAULT_SERVER_HASH_MB = 256;
+const long long DEFAULT_SERVER_BUDGET_MS = 30000;
+const int KPK_INDEX_COUNT = 2 * 24 * 64 * 64;   // Side to move, pawn on files a-d of ranks 2-7, both kings
+const int KPK_WIN_SCORE = 500;
+const int KPK_RANK_BONUS = 20;
+
+#ifndef SLOWFISH_STATS
+#define SLOWFISH_STATS 1
+#endif
+constexpr bool STATS_ENABLED = SLOWFISH_STATS; // Build with -DSLOWFISH_STATS=0 to compile the counters out
+
+#ifndef SLOWFISH_PROFILE
+#define SLOWFISH_PROFILE 0
+#endif
+constexpr bool PROFILE_ENABLED = SLOWFISH_PROFILE; // Build with -DSLOWFISH_PROFILE=1 to time the hot functions
+
+#ifndef SLOWFISH_TRACE
+#define SLOWFISH_TRACE 0
+#endif
+constexpr bool TRACE_ENABLED = SLOWFISH_TRACE; // Build with -DSLOWFISH_TRACE=1 to record searched nodes to a TraceFile
 
 enum PIECES {
     EMPTY = 0,
@@ -54,13 +135,71 @@ const int MOVE_FLAG_CASTLE = 0x1000000;
 const int MOVE_FLAG_CAPTURE_MASK = 0x7C000;
 const int MOVE_FLAG_PROMOTION_MASK = 0xF00000;
 
-int BoardFiles[BOARD_SQUARES_NUMBER];
-int BoardRanks[BOARD_SQUARES_NUMBER];
-int index120To64[BOARD_SQUARES_NUMBER];
-int index64To120[64];
-int PieceKeys[14 * 120];
-int SideKey;
-int CastleKeys[16];
+constexpr int FR2SQ(int f, int r) {
+    return ((21 + (f)) + ((r) * 10));
+}
+
+// The lookup tables and hash keys below are generated at compile time, so they live in read-only data
+// shared by every engine process and need no initialisation at startup
+constexpr std::array<int, BOARD_SQUARES_NUMBER> MakeFilesRanksBrd(int ranks) {
+    std::array<int, BOARD_SQUARES_NUMBER> table{};
+    for (int index = 0; index < BOARD_SQUARES_NUMBER; ++index) {
+        table[index] = OFFBOARD;
+    }
+    for (int rank = RANK_1; rank <= RANK_8; ++rank) {
+        for (int file = FILE_A; file <= FILE_H; ++file) {
+            table[FR2SQ(file, rank)] = ranks ? rank : file;
+        }
+    }
+    return table;
+}
+
+constexpr std::array<int, BOARD_SQUARES_NUMBER> MakeSq120To64() {
+    std::array<int, BOARD_SQUARES_NUMBER> table{};
+    for (int index = 0; index < BOARD_SQUARES_NUMBER; ++index) {
+        table[index] = 65;
+    }
+    for (int sq64 = 0; sq64 < 64; ++sq64) {
+        table[FR2SQ(sq64 % 8, sq64 / 8)] = sq64;
+    }
+    return table;
+}
+
+constexpr std::array<int, 64> MakeSq64To120() {
+    std::array<int, 64> table{};
+    for (int sq64 = 0; sq64 < 64; ++sq64) {
+        table[sq64] = FR2SQ(sq64 % 8, sq64 / 8);
+    }
+    return table;
+}
+
+// The index-th output of a SplitMix64 generator started at seed
+constexpr uint64_t SplitMix64(uint64_t seed, uint64_t index) {
+    uint64_t z = seed + (index + 1) * 0x9E3779B97F4A7C15ULL;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+template <typename Key, size_t Count>
+constexpr std::array<Key, Count> MakeHashKeys(uint64_t seed, uint64_t first) {
+    std::array<Key, Count> keys{};
+    for (size_t index = 0; index < Count; ++index) {
+        keys[index] = static_cast<Key>(SplitMix64(seed, first + index) >> (64 - 8 * sizeof(Key)));
+    }
+    return keys;
+}
+
+constexpr uint64_t HASH_SEED_64 = 0x736C6F7766697368ULL;
+
+constexpr std::array<int, BOARD_SQUARES_NUMBER> BoardFiles = MakeFilesRanksBrd(false);
+constexpr std::array<int, BOARD_SQUARES_NUMBER> BoardRanks = MakeFilesRanksBrd(true);
+constexpr std::array<int, BOARD_SQUARES_NUMBER> index120To64 = MakeSq120To64();
+constexpr std::array<int, 64> index64To120 = MakeSq64To120();
+// 64-bit keys from a fixed seed, so they are the same in every build and can be stored on disk
+constexpr std::array<uint64_t, 14 * 120> PieceKeys64 = MakeHashKeys<uint64_t, 14 * 120>(HASH_SEED_64, 0);
+constexpr uint64_t SideKey64 = SplitMix64(HASH_SEED_64, 14 * 120);
+constexpr std::array<uint64_t, 16> CastleKeys64 = MakeHashKeys<uint64_t, 16>(HASH_SEED_64, 14 * 120 + 1);
 
 const char PieceChar[] = ".PNBRQKpnbrqk";
 const char SideChar[] = "wb-";
@@ -117,87 +256,200 @@ const int CastlePerm[] = {
     15, 15, 15, 15, 15, 15, 15, 15, 15, 15
 };
 
-int PawnRanksWhite[10];
-int PawnRanksBlack[10];
-
-const int PawnIsolated = -10;
-const int PawnPassed[] = {0, 5, 10, 20, 35, 60, 100, 200};
-
-const int PawnTable[] = {
-    0,  0,  0,  0,  0,  0,  0,  0,
-    10, 10,  0,-10,-10,  0, 10, 10,
-    5,  0,  0,  5,  5,  0,  0,  5,
-    0,  0, 10, 20, 20, 10,  0,  0,
-    5,  5,  5, 10, 10,  5,  5,  5,
-    10, 10, 10, 20, 20, 10, 10, 10,
-    20, 20, 20, 30, 30, 20, 20, 20,
-    0,  0,  0,  0,  0,  0,  0,  0
-};
+thread_local int PawnRanksWhite[10];
+thread_local int PawnRanksBlack[10];
 
-const int KnightTable[] = {
-    0,-10,  0,  0,  0,  0,-10,  0,
-    0,  0,  0,  5,  5,  0,  0,  0,
-    0,  0, 10, 10, 10, 10,  0,  0,
-    0,  0, 10, 20, 20, 10,  5,  0,
-    5, 10, 15, 20, 20, 15, 10,  5,
-    5, 10, 10, 20, 20, 10, 10,  5,
-    0,  0,  5, 10, 10,  5,  0,  0,
-    0,  0,  0,  0,  0,  0,  0,  0
+// Every evaluation weight, so that they can be loaded from a file and tuned. The piece-square tables are
+// from white's point of view with a1 first; rook and queen share rookTable.
+struct EvalParams {
+    int material[5];            // Pawn, knight, bishop, rook, queen
+    int pawnIsolated;
+    int pawnPassed[8];          // By rank from the pawn's own side
+    int pawnTable[64];
+    int knightTable[64];
+    int bishopTable[64];
+    int rookTable[64];
+    int kingEndgame[64];
+    int kingOpening[64];
+    int rookOpenFile;
+    int rookSemiOpenFile;
+    int queenOpenFile;
+    int queenSemiOpenFile;
+    int bishopPair;
 };
 
-const int BishopTable[] = {
-    0,  0,-10,  0,  0,-10,  0,  0,
-    0,  0,  0, 10, 10,  0,  0,  0,
-    0,  0, 10, 15, 15, 10,  0,  0,
-    0, 10, 15, 20, 20, 15, 10,  0,
-    0, 10, 15, 20, 20, 15, 10,  0,
-    0,  0, 10, 15, 15, 10,  0,  0,
-    0,  0,  0, 10, 10,  0,  0,  0,
-    0,  0,  0,  0,  0,  0,  0,  0
-};
+const int EVAL_PARAM_COUNT = sizeof(EvalParams) / sizeof(int);
 
-const int RookTable[] = {
-    0,  0,  5, 10, 10,  5,  0,  0,
-    0,  0,  5, 10, 10,  5,  0,  0,
-    0,  0,  5, 10, 10,  5,  0,  0,
-    0,  0,  5, 10, 10,  5,  0,  0,
-    0,  0,  5, 10, 10,  5,  0,  0,
-    0,  0,  5, 10, 10,  5,  0,  0,
-    25, 25, 25, 25, 25, 25, 25, 25,
-    0,  0,  5, 10, 10,  5,  0,  0
+// The compiled-in weights, used by every thread that has not loaded an EvalFile
+const EvalParams DefaultEvalParams = {
+    {100, 325, 325, 550, 1000},
+    -10,
+    {0, 5, 10, 20, 35, 60, 100, 200},
+    {
+        0,  0,  0,  0,  0,  0,  0,  0,
+        10, 10,  0,-10,-10,  0, 10, 10,
+        5,  0,  0,  5,  5,  0,  0,  5,
+        0,  0, 10, 20, 20, 10,  0,  0,
+        5,  5,  5, 10, 10,  5,  5,  5,
+        10, 10, 10, 20, 20, 10, 10, 10,
+        20, 20, 20, 30, 30, 20, 20, 20,
+        0,  0,  0,  0,  0,  0,  0,  0
+    },
+    {
+        0,-10,  0,  0,  0,  0,-10,  0,
+        0,  0,  0,  5,  5,  0,  0,  0,
+        0,  0, 10, 10, 10, 10,  0,  0,
+        0,  0, 10, 20, 20, 10,  5,  0,
+        5, 10, 15, 20, 20, 15, 10,  5,
+        5, 10, 10, 20, 20, 10, 10,  5,
+        0,  0,  5, 10, 10,  5,  0,  0,
+        0,  0,  0,  0,  0,  0,  0,  0
+    },
+    {
+        0,  0,-10,  0,  0,-10,  0,  0,
+        0,  0,  0, 10, 10,  0,  0,  0,
+        0,  0, 10, 15, 15, 10,  0,  0,
+        0, 10, 15, 20, 20, 15, 10,  0,
+        0, 10, 15, 20, 20, 15, 10,  0,
+        0,  0, 10, 15, 15, 10,  0,  0,
+        0,  0,  0, 10, 10,  0,  0,  0,
+        0,  0,  0,  0,  0,  0,  0,  0
+    },
+    {
+        0,  0,  5, 10, 10,  5,  0,  0,
+        0,  0,  5, 10, 10,  5,  0,  0,
+        0,  0,  5, 10, 10,  5,  0,  0,
+        0,  0,  5, 10, 10,  5,  0,  0,
+        0,  0,  5, 10, 10,  5,  0,  0,
+        0,  0,  5, 10, 10,  5,  0,  0,
+        25, 25, 25, 25, 25, 25, 25, 25,
+        0,  0,  5, 10, 10,  5,  0,  0
+    },
+    {
+       -50,-10,  0,  0,  0,  0,-10,-50,
+       -10,  0, 10, 10, 10, 10,  0,-10,
+        0, 10, 20, 20, 20, 20, 10,  0,
+        0, 10, 20, 40, 40, 20, 10,  0,
+        0, 10, 20, 40, 40, 20, 10,  0,
+        0, 10, 20, 20, 20, 20, 10,  0,
+       -10,  0, 10, 10, 10, 10,  0,-10,
+       -50,-10,  0,  0,  0,  0,-10,-50
+    },
+    {
+        0,  5,  5,-10,-10,  0, 10,  5,
+       -30,-30,-30,-30,-30,-30,-30,-30,
+       -50,-50,-50,-50,-50,-50,-50,-50,
+       -70,-70,-70,-70,-70,-70,-70,-70,
+       -70,-70,-70,-70,-70,-70,-70,-70,
+       -70,-70,-70,-70,-70,-70,-70,-70,
+       -70,-70,-70,-70,-70,-70,-70,-70,
+       -70,-70,-70,-70,-70,-70,-70,-70
+    },
+    10,
+    5,
+    5,
+    3,
+    30
 };
 
-const int KingInEndgame[] = {
-   -50,-10,  0,  0,  0,  0,-10,-50,
-   -10,  0, 10, 10, 10, 10,  0,-10,
-    0, 10, 20, 20, 20, 20, 10,  0,
-    0, 10, 20, 40, 40, 20, 10,  0,
-    0, 10, 20, 40, 40, 20, 10,  0,
-    0, 10, 20, 20, 20, 20, 10,  0,
-   -10,  0, 10, 10, 10, 10,  0,-10,
-   -50,-10,  0,  0,  0,  0,-10,-50
+// Names and positions of the parameters in the text format read by LoadEvalParams
+struct EvalParamGroup {
+    const char* name;
+    size_t offset;
+    int count;
 };
 
-const int KingInOpening[] = {
-    0,  5,  5,-10,-10,  0, 10,  5,
-   -30,-30,-30,-30,-30,-30,-30,-30,
-   -50,-50,-50,-50,-50,-50,-50,-50,
-   -70,-70,-70,-70,-70,-70,-70,-70,
-   -70,-70,-70,-70,-70,-70,-70,-70,
-   -70,-70,-70,-70,-70,-70,-70,-70,
-   -70,-70,-70,-70,-70,-70,-70,-70,
-   -70,-70,-70,-70,-70,-70,-70,-70
+const EvalParamGroup EvalParamGroups[] = {
+    {"material", offsetof(EvalParams, material), 5},
+    {"pawnIsolated", offsetof(EvalParams, pawnIsolated), 1},
+    {"pawnPassed", offsetof(EvalParams, pawnPassed), 8},
+    {"pawnTable", offsetof(EvalParams, pawnTable), 64},
+    {"knightTable", offsetof(EvalParams, knightTable), 64},
+    {"bishopTable", offsetof(EvalParams, bishopTable), 64},
+    {"rookTable", offsetof(EvalParams, rookTable), 64},
+    {"kingEndgame", offsetof(EvalParams, kingEndgame), 64},
+    {"kingOpening", offsetof(EvalParams, kingOpening), 64},
+    {"rookOpenFile", offsetof(EvalParams, rookOpenFile), 1},
+    {"rookSemiOpenFile", offsetof(EvalParams, rookSemiOpenFile), 1},
+    {"queenOpenFile", offsetof(EvalParams, queenOpenFile), 1},
+    {"queenSemiOpenFile", offsetof(EvalParams, queenSemiOpenFile), 1},
+    {"bishopPair", offsetof(EvalParams, bishopPair), 1},
 };
 
-const int ROOK_OPEN_FILE = 10;
-const int ROOK_SEMI_OPEN_FILE = 5;
-const int QUEEN_OPEN_FILE = 5;
-const int QUEEN_SEMI_OPEN_FILE = 3;
-const int BISHOP_PAIR = 30;
+inline int* EvalParamData(EvalParams& params) {
+    return reinterpret_cast<int*>(&params);
+}
+
+inline const int* EvalParamData(const EvalParams& params) {
+    return reinterpret_cast<const int*>(&params);
+}
+
+// Weights loaded with EvalFile. They are per thread, so each Engine instance evaluates with its own, and a load
+// replaces the pointer instead of writing over weights another search may be reading.
+thread_local std::shared_ptr<const EvalParams> loadedEvalParams;
+
+inline const EvalParams& ActiveEvalParams() {
+    return loadedEvalParams ? *loadedEvalParams : DefaultEvalParams;
+}
+
+// Reads each group's name followed by its values, as written by SaveEvalParams. Groups missing from the file keep
+// their current values.
+bool LoadEvalParams(const std::string& path, EvalParams& params) {
+    std::ifstream in(path);
+    if (!in) return false;
+    
+    EvalParams loaded = params;
+    std::string name;
+    while (in >> name) {
+        const EvalParamGroup* group = nullptr;
+        for (const EvalParamGroup& candidate : EvalParamGroups) {
+            if (name == candidate.name) group = &candidate;
+        }
+        if (group == nullptr) return false;
+        int* values = EvalParamData(loaded) + group->offset / sizeof(int);
+        for (int i = 0; i < group->count; ++i) {
+            if (!(in >> values[i])) return false;
+        }
+    }
+    params = loaded;
+    return true;
+}
+
+bool SaveEvalParams(const std::string& path, EvalParams& params) {
+    std::ofstream out(path);
+    for (const EvalParamGroup& group : EvalParamGroups) {
+        out << group.name;
+        const int* values = EvalParamData(params) + group.offset / sizeof(int);
+        for (int i = 0; i < group.count; ++i) {
+            out << ((group.count == 64 && i % 8 == 0) ? "\n   " : " ") << values[i];
+        }
+        out << "\n";
+    }
+    return static_cast<bool>(out);
+}
+
 const int ENDGAME_MAT = 1 * PieceVal[WHITE_ROOK] + 2 * PieceVal[WHITE_KNIGHT] + 2 * PieceVal[WHITE_PAWN] + PieceVal[WHITE_KING];
 
-int VictimScore[] = {0, 100, 200, 300, 400, 500, 600, 100, 200, 300, 400, 500, 600};
-int MostValubleVictimLeastValuableAttackerScores[14 * 14]; // Longest variable name ever
+constexpr int VictimScore[] = {0, 100, 200, 300, 400, 500, 600, 100, 200, 300, 400, 500, 600};
+
+constexpr std::array<int, 14 * 14> MakeMvvLva() {
+    std::array<int, 14 * 14> table{};
+    for (int Attacker = WHITE_PAWN; Attacker <= BLACK_KING; ++Attacker) {
+        for (int Victim = WHITE_PAWN; Victim <= BLACK_KING; ++Victim) {
+            table[Victim * 14 + Attacker] = VictimScore[Victim] + 6 - (VictimScore[Attacker] / 100);
+        }
+    }
+    return table;
+}
+
+constexpr std::array<int, 14 * 14> MostValubleVictimLeastValuableAttackerScores = MakeMvvLva(); // Longest variable name ever
+
+// Move list entries keep the full 32-bit move, since making, unmaking and ordering a move read its captured piece and
+// flags straight from it. Only hash entries hold the 16-bit PackMove form.
+struct ScoredMove {
+    int move;
+    int score;
+};
 
 struct Board {
     int side;
@@ -207,48 +459,91 @@ struct Board {
     int ply;
     int hisPly;
     int castlePerm;
-    int posKey;
+    uint64_t posKey;            // Kept equal to GeneratePosKey64 by MakeMove and TakeMove
     int pieceNum[13];
     int material[2];
     int pList[14 * 10];
+    int pListIndex[BOARD_SQUARES_NUMBER]; // Slot in pList of the piece on each occupied square
     int fullMoveCount;
     
-    int moveList[MAX_DEPTH * MAX_POSITION_MOVES];
-    int moveScores[MAX_DEPTH * MAX_POSITION_MOVES];
+    ScoredMove moveList[MAX_DEPTH * MAX_POSITION_MOVES];
     int moveListStart[MAX_DEPTH];
     
     int searchHistory[14 * BOARD_SQUARES_NUMBER];
     int searchKillers[3 * MAX_DEPTH];
+    int counterMoves[CONTINUATION_SIZE];         // Indexed by the previous move's piece and destination
+    int16_t* continuationHistory;                // CONTINUATION_SIZE rows of CONTINUATION_SIZE, allocated by SearchPosition
+    int16_t* continuationRows[2];                // Rows for the moves one and two plies back, set by GenerateMoves
+    int counterMove;                             // Counter move to the previous move, set by GenerateMoves
+    int nullHisPly;                              // hisPly of the innermost null move being searched, 0 outside one
 
     struct PvEntry {
-        int move;
-        int posKey;
+        std::atomic<uint32_t> data; // Key check in the upper 16 bits and the PackMove move in the lower. Server pool
+                                    // threads share the table, so it is only read and written whole, with relaxed atomics.
     };
-    PvEntry PvTable[MAX_PV_TABLE_ENTRIES];
+    PvEntry* PvTable;           // Allocated by ClearPvTable with search.hashMb megabytes
+    size_t PvTableEntries;
+    uint32_t PvTableMask;
+    int PvTableLargePages;
     int PvArray[MAX_DEPTH];
     
     struct HistoryEntry {
         int move;
+        int movedPiece;
         int castlePerm;
         int enPas;
         int fiftyMove;
-        int posKey;
+        uint64_t posKey;
         int fullMoveCount;
     };
     HistoryEntry history[MAX_GAME_MOVES];
 };
 
+static_assert(sizeof(Board::PvEntry) == 4, "MAX_HASH_MB assumes four-byte hash entries");
+
+struct PvLine {
+    int moves[MAX_DEPTH];
+    int length;
+    int score;
+    int depth;
+};
+
+struct RootMove {
+    PvLine line;        // line.score is -INFINITE when the move failed low in the last iteration
+    long long nodes;    // Size of the move's subtree in the last iteration
+    int orderScore;     // Move generator score, which includes the killers and history of the last iteration
+};
+
 struct Search {
     long long nodes;
-    int fh;
-    int fhf;
+    long long fh;
+    long long fhf;
     int depth;
+    int seldepth;
     long long time;
+    long long nodeLimit;
     long long start;
-    int stop;
+    std::atomic<int> stop;
     int best;
+    int score;
+    int pvNum;
+    int completedDepth;
     int thinking;
-} search;
+    int quiet;
+    int multiPv;
+    int hashMb;
+    int mateHashMb;
+    int keepHash;             // Keeps the hash table between searches, e.g. for consecutive positions of one game
+    long long moveTimeCap;    // Longest time one go may search, 0 for no cap
+    long long queuedTime;     // Milliseconds a server request waited for a thread, taken off its move time
+    PvLine lines[MAX_MULTI_PV];
+    int seedMoves[MAX_DEPTH];
+    int seedLength;
+    RootMove rootMoves[MAX_POSITION_MOVES];
+    int rootMoveNum;
+    int searchMoves[MAX_POSITION_MOVES];
+    int searchMoveNum;
+};
 
 struct GameController {
     int EngineSide;
@@ -258,10 +553,126 @@ struct GameController {
     int GameSaved;
 } gameController;
 
-Board board;
+// Each thread gets its own board and search state, so several searches can run side by side
+thread_local Board board;
+thread_local Search search;
+thread_local std::function<void()> iterationCallback;
+thread_local std::function<void()> pollCallback; // Called from CheckUp while searching
+thread_local std::function<void(const std::string&)> outputCallback;
+std::mutex coutMutex;
+int clusterWorker = false;
+
+struct SearchStats {
+    long long qnodes;
+    long long nullTries;
+    long long nullCutoffs;
+    long long hashProbes;
+    long long hashHits;
+    long long cutoffIndex[8];
+    long long plyNodes[MAX_DEPTH + 1];
+    long long iterationNodes[MAX_DEPTH + 1];
+};
+thread_local SearchStats stats;
+
+enum PROFILED_FUNCTIONS {
+    PROF_GENERATE_MOVES, PROF_GENERATE_CAPTURES, PROF_MAKE_MOVE, PROF_TAKE_MOVE,
+    PROF_SQ_ATTACKED, PROF_EVAL_POSITION, PROF_PICK_NEXT_MOVE, PROF_IS_REPETITION, PROF_COUNT
+};
+
+const char* const ProfileNames[] = {
+    "GenerateMoves", "GenerateCaptures", "MakeMove", "TakeMove",
+    "SqAttacked", "EvalPosition", "PickNextMove", "IsRepetition"
+};
+
+struct ProfileCounters {
+    unsigned long long calls[PROF_COUNT];
+    unsigned long long cycles[PROF_COUNT];
+};
+thread_local ProfileCounters profile;
+
+enum TRACE_FLAGS { TRACE_QSEARCH = 1, TRACE_NULL = 2 };
+
+// What PickNextMove scored the move that failed high as, kept in bits 4-6 of the record flags
+enum TRACE_MOVE_KINDS {
+    TRACE_KIND_NONE, TRACE_KIND_HASH, TRACE_KIND_CAPTURE, TRACE_KIND_KILLER, TRACE_KIND_COUNTER, TRACE_KIND_QUIET, TRACE_KIND_COUNT
+};
+
+const char* const TraceKindNames[] = { "none", "hash", "capture", "killer", "counter", "quiet" };
+
+// One searched node of a trace file. Nodes are written when they return, so children come before their parent.
+// The file is the 8 byte TRACE_MAGIC followed by these records.
+struct TraceRecord {
+    uint32_t key;
+    uint32_t move;        // Move that led to the node, NO_MOVE for null move searches
+    uint32_t nodes;       // Nodes in the subtree, including this one
+    int16_t alpha;
+    int16_t beta;
+    int16_t score;
+    uint8_t ply;
+    int8_t depth;         // Remaining depth, 0 in quiescence
+    uint8_t iteration;
+    uint8_t flags;
+    uint8_t cutoff;       // 1 when the first legal move failed high, 2 for the second and so on, 0 without a cutoff
+    uint8_t picked;       // Moves PickNextMove handed out, including illegal ones
+};
+static_assert(sizeof(TraceRecord) == 24, "trace records must stay 24 bytes");
+
+const char TRACE_MAGIC[8] = {'S', 'F', 'T', 'R', 'A', 'C', 'E', '1'};
+
+struct TraceFrame {
+    int picked;
+    int pickScore;
+    int cutoff;
+    int cutoffScore;
+};
+
+struct SearchTrace {
+    FILE* file;
+    int maxPly;           // 0 records every ply
+    long long nodeBudget; // Records per search, 0 for no limit
+    long long written;
+    int iteration;
+    TraceFrame frames[MAX_DEPTH + 2];
+};
+thread_local SearchTrace trace;
+
+inline unsigned long long ReadCycles() {
+#if defined(_MSC_VER) || defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+// Times the enclosing function (including its callees) when profiling is compiled in, and is empty otherwise
+template <int Function>
+struct ProfileScope {
+    unsigned long long start;
+    
+    ProfileScope() {
+        if (PROFILE_ENABLED) start = ReadCycles();
+    }
+    
+    ~ProfileScope() {
+        if (PROFILE_ENABLED) {
+            profile.calls[Function]++;
+            profile.cycles[Function] += ReadCycles() - start;
+        }
+    }
+};
+
+void WriteLine(const std::string& line) {
+    std::lock_guard<std::mutex> lock(coutMutex);
+    std::cout << line << std::endl;
+}
 
-inline int RAND_32() {
-    return (rand() % 256 << 23) | (rand() % 256 << 16) | (rand() % 256 << 8) | (rand() % 256);
+// Engine output goes to the thread's output callback when one is installed, otherwise straight to stdout
+void UciOut(const std::string& line) {
+    if (outputCallback) {
+        outputCallback(line);
+        return;
+    }
+    WriteLine(line);
 }
 
 inline int FROMSQ(int m) { return (m & 0x7F); }
@@ -273,10 +684,6 @@ inline int PCEINDEX(int piece, int pieceNum) {
     return (piece * 10 + pieceNum);
 }
 
-inline int FR2SQ(int f, int r) {
-    return ((21 + (f)) + ((r) * 10));
-}
-
 inline int SQ64(int sq120) {
     return index120To64[sq120];
 }
@@ -295,19 +702,19 @@ inline int SQOFFBOARD(int sq) {
 }
 
 inline void HASH_PCE(int piece, int sq) {
-    board.posKey ^= PieceKeys[(piece * 120) + sq];
+    board.posKey ^= PieceKeys64[(piece * 120) + sq];
 }
 
 inline void HASH_CA() { 
-    board.posKey ^= CastleKeys[board.castlePerm]; 
+    board.posKey ^= CastleKeys64[board.castlePerm]; 
 }
 
 inline void HASH_SIDE() { 
-    board.posKey ^= SideKey; 
+    board.posKey ^= SideKey64; 
 }
 
 inline void HASH_EP() { 
-    board.posKey ^= PieceKeys[board.enPas]; 
+    board.posKey ^= PieceKeys64[board.enPas]; 
 }
 
 int SqFromAlg(const std::string& moveAlg) {
@@ -322,6 +729,8 @@ int SqFromAlg(const std::string& moveAlg) {
 }
 
 std::string PrMove(int move) {
+    if (move == NO_MOVE) return "0000";
+    
     std::string MvStr;
     
     int ff = BoardFiles[FROMSQ(move)];
@@ -350,80 +759,118 @@ std::string PrMove(int move) {
     return MvStr;
 }
 
-void InitFilesRanksBrd() {
-    int file = FILE_A;
-    int rank = RANK_1;
-    int sq = A1;
-    
-    for (int index = 0; index < BOARD_SQUARES_NUMBER; ++index) {
-        BoardFiles[index] = OFFBOARD;
-        BoardRanks[index] = OFFBOARD;
-    }
-    
-    for (rank = RANK_1; rank <= RANK_8; ++rank) {
-        for (file = FILE_A; file <= FILE_H; ++file) {
-            sq = FR2SQ(file, rank);
-            BoardFiles[sq] = file;
-            BoardRanks[sq] = rank;
+enum KPK_RESULTS { KPK_INVALID = 0, KPK_UNKNOWN = 1, KPK_DRAW = 2, KPK_WIN = 4 };
+
+// One bit per KPK position with white holding the pawn, set when white wins. Built by KpkInit at startup.
+std::array<uint64_t, KPK_INDEX_COUNT / 64> KpkBitbase;
+
+// Squares are 0-63 from a1, and the pawn is on files a-d; positions with the pawn elsewhere are mirrored first
+inline int KpkIndex(int side, int blackKing, int whiteKing, int pawn) {
+    return whiteKing | (blackKing << 6) | (side << 12) | ((pawn & 7) << 13) | ((RANK_7 - pawn / 8) << 15);
+}
+
+inline int KpkDistance(int sq1, int sq2) {
+    return std::max(std::abs(sq1 % 8 - sq2 % 8), std::abs(sq1 / 8 - sq2 / 8));
+}
+
+inline int KpkPawnAttacks(int pawn, int sq) {
+    return sq / 8 == pawn / 8 + 1 && std::abs(sq % 8 - pawn % 8) == 1;
+}
+
+// The squares a king on each square can step to, ended by -1
+constexpr std::array<std::array<int, 9>, 64> MakeKpkKingSteps() {
+    std::array<std::array<int, 9>, 64> steps{};
+    for (int sq = 0; sq < 64; ++sq) {
+        int count = 0;
+        for (int fileStep = -1; fileStep <= 1; ++fileStep) {
+            for (int rankStep = -1; rankStep <= 1; ++rankStep) {
+                int file = sq % 8 + fileStep;
+                int rank = sq / 8 + rankStep;
+                if ((fileStep != 0 || rankStep != 0) && file >= 0 && file < 8 && rank >= 0 && rank < 8) steps[sq][count++] = rank * 8 + file;
+            }
         }
+        while (count < 9) steps[sq][count++] = -1;
     }
+    return steps;
 }
 
-void InitSq120To64() {
-    int file = FILE_A;
-    int rank = RANK_1;
-    int sq = A1;
-    int sq64 = 0;
-    
-    for (int index = 0; index < BOARD_SQUARES_NUMBER; ++index) {
-        index120To64[index] = 65;
+constexpr std::array<std::array<int, 9>, 64> KpkKingSteps = MakeKpkKingSteps();
+
+// Results that follow from the position alone: illegal positions, immediate safe promotions, stalemates and
+// undefended pawns the black king can take. Everything else starts out unknown.
+int KpkInitialResult(int index) {
+    int whiteKing = index & 63;
+    int blackKing = (index >> 6) & 63;
+    int side = (index >> 12) & 1;
+    int pawn = ((index >> 13) & 3) + 8 * (RANK_7 - (index >> 15));
+    
+    if (KpkDistance(whiteKing, blackKing) <= 1 || whiteKing == pawn || blackKing == pawn ||
+        (side == WHITE && KpkPawnAttacks(pawn, blackKing))) {
+        return KPK_INVALID;
     }
-    
-    for (int index = 0; index < 64; ++index) {
-        index64To120[index] = 120;
+    if (side == WHITE && pawn / 8 == RANK_7 && whiteKing != pawn + 8 && blackKing != pawn + 8 &&
+        (KpkDistance(blackKing, pawn + 8) > 1 || KpkDistance(whiteKing, pawn + 8) == 1)) {
+        return KPK_WIN;
     }
-    
-    for (rank = RANK_1; rank <= RANK_8; ++rank) {
-        for (file = FILE_A; file <= FILE_H; ++file) {
-            sq = FR2SQ(file, rank);
-            index64To120[sq64] = sq;
-            index120To64[sq] = sq64;
-            sq64++;
+    if (side == BLACK) {
+        int canMove = false;
+        for (const int* step = KpkKingSteps[blackKing].data(); *step >= 0; ++step) {
+            if (KpkDistance(*step, whiteKing) > 1 && !KpkPawnAttacks(pawn, *step)) canMove = true;
         }
+        if (!canMove) return KpkPawnAttacks(pawn, blackKing) ? KPK_WIN : KPK_DRAW;
+        if (KpkDistance(blackKing, pawn) == 1 && KpkDistance(whiteKing, pawn) > 1) return KPK_DRAW;
     }
+    return KPK_UNKNOWN;
 }
 
-void InitHashKeys() {
-    for (int index = 0; index < 13 * 120; ++index) {
-        PieceKeys[index] = RAND_32();
+// A position is won for white if one white move reaches a win, and drawn if every black move reaches a draw.
+// Moves into illegal positions look up KPK_INVALID and add nothing.
+int KpkClassify(const std::vector<uint8_t>& results, int index) {
+    int whiteKing = index & 63;
+    int blackKing = (index >> 6) & 63;
+    int side = (index >> 12) & 1;
+    int pawn = ((index >> 13) & 3) + 8 * (RANK_7 - (index >> 15));
+    int good = (side == WHITE) ? KPK_WIN : KPK_DRAW;
+    int bad = (side == WHITE) ? KPK_DRAW : KPK_WIN;
+    
+    int result = KPK_INVALID;
+    for (const int* step = KpkKingSteps[side == WHITE ? whiteKing : blackKing].data(); *step >= 0; ++step) {
+        result |= (side == WHITE) ? results[KpkIndex(BLACK, blackKing, *step, pawn)] : results[KpkIndex(WHITE, *step, whiteKing, pawn)];
     }
-    
-    SideKey = RAND_32();
-    
-    for (int index = 0; index < 16; ++index) {
-        CastleKeys[index] = RAND_32();
+    if (side == WHITE && pawn / 8 < RANK_7) {
+        result |= results[KpkIndex(BLACK, blackKing, whiteKing, pawn + 8)];
+        if (pawn / 8 == RANK_2 && pawn + 8 != whiteKing && pawn + 8 != blackKing) {
+            result |= results[KpkIndex(BLACK, blackKing, whiteKing, pawn + 16)];
+        }
     }
+    return (result & good) ? good : (result & KPK_UNKNOWN) ? KPK_UNKNOWN : bad;
 }
 
-void InitBoardVars() {
-    for (int index = 0; index < MAX_GAME_MOVES; index++) {
-        board.history[index] = {
-            NO_MOVE, 0, 0, 0, 0, 0
-        };
+// Retrograde iteration: unknown positions are classified from their successors until nothing changes,
+// and whatever is still unknown then is a draw. Each pass only visits the positions still unknown.
+void KpkInit() {
+    std::vector<uint8_t> results(KPK_INDEX_COUNT);
+    std::vector<int> unknown;
+    for (int index = 0; index < KPK_INDEX_COUNT; ++index) {
+        results[index] = static_cast<uint8_t>(KpkInitialResult(index));
+        if (results[index] == KPK_UNKNOWN) unknown.push_back(index);
     }
     
-    for (int index = 0; index < MAX_PV_TABLE_ENTRIES; index++) {
-        board.PvTable[index] = {
-            NO_MOVE, 0
-        };
-    }
-}
-
-void InitMvvLva() {
-    for (int Attacker = WHITE_PAWN; Attacker <= BLACK_KING; ++Attacker) {
-        for (int Victim = WHITE_PAWN; Victim <= BLACK_KING; ++Victim) {
-            MostValubleVictimLeastValuableAttackerScores[Victim * 14 + Attacker] = VictimScore[Victim] + 6 - (VictimScore[Attacker] / 100);
+    size_t previous = 0;
+    while (unknown.size() != previous) {
+        previous = unknown.size();
+        size_t kept = 0;
+        for (int index : unknown) {
+            int result = KpkClassify(results, index);
+            results[index] = static_cast<uint8_t>(result);
+            if (result == KPK_UNKNOWN) unknown[kept++] = index;
         }
+        unknown.resize(kept);
+    }
+    
+    KpkBitbase.fill(0);
+    for (int index = 0; index < KPK_INDEX_COUNT; ++index) {
+        if (results[index] == KPK_WIN) KpkBitbase[index / 64] |= 1ULL << (index % 64);
     }
 }
 
@@ -434,13 +881,11 @@ void EvalInit() {
     }
 }
 
+std::once_flag initFlag;
+
 void init() {
-    InitFilesRanksBrd();
-    InitSq120To64();
-    InitHashKeys();
-    InitBoardVars();
-    InitMvvLva();
     EvalInit();
+    KpkInit();
     search.thinking = false;
 }
 
@@ -454,6 +899,7 @@ void UpdateListsMaterial() {
             board.material[colour] += PieceVal[piece];
             
             board.pList[PCEINDEX(piece, board.pieceNum[piece])] = sq;
+            board.pListIndex[sq] = board.pieceNum[piece];
             board.pieceNum[piece]++;
         }
     }
@@ -485,30 +931,31 @@ void ResetBoard() {
     board.fiftyMove = 0;
     board.ply = 0;
     board.hisPly = 0;
+    board.nullHisPly = 0;
     board.castlePerm = 0;
     board.posKey = 0;
     board.moveListStart[board.ply] = 0;
 }
 
-int GeneratePosKey() {
-    int finalKey = 0;
+uint64_t GeneratePosKey64() {
+    uint64_t finalKey = 0;
     
     for (int sq = 0; sq < BOARD_SQUARES_NUMBER; ++sq) {
         int piece = board.pieces[sq];
         if (piece != EMPTY && piece != OFFBOARD) {
-            finalKey ^= PieceKeys[(piece * 120) + sq];
+            finalKey ^= PieceKeys64[(piece * 120) + sq];
         }
     }
     
     if (board.side == WHITE) {
-        finalKey ^= SideKey;
+        finalKey ^= SideKey64;
     }
     
     if (board.enPas != NO_SQ) {
-        finalKey ^= PieceKeys[board.enPas];
+        finalKey ^= PieceKeys64[board.enPas];
     }
     
-    finalKey ^= CastleKeys[board.castlePerm];
+    finalKey ^= CastleKeys64[board.castlePerm];
     
     return finalKey;
 }
@@ -595,11 +1042,46 @@ void ParseFen(const std::string& fen) {
         board.fullMoveCount = std::stoi(fen.substr(lastSpace + 1));
     }
     
-    board.posKey = GeneratePosKey();
+    board.posKey = GeneratePosKey64();
     UpdateListsMaterial();
 }
 
+std::string BoardToFen() {
+    std::string fen;
+    for (int rank = RANK_8; rank >= RANK_1; --rank) {
+        int empty = 0;
+        for (int file = FILE_A; file <= FILE_H; ++file) {
+            int piece = board.pieces[FR2SQ(file, rank)];
+            if (piece == EMPTY) {
+                empty++;
+                continue;
+            }
+            if (empty > 0) fen += static_cast<char>('0' + empty);
+            empty = 0;
+            fen += PieceChar[piece];
+        }
+        if (empty > 0) fen += static_cast<char>('0' + empty);
+        if (rank > RANK_1) fen += '/';
+    }
+    
+    fen += (board.side == WHITE) ? " w " : " b ";
+    if (board.castlePerm & WKCA) fen += 'K';
+    if (board.castlePerm & WQCA) fen += 'Q';
+    if (board.castlePerm & BKCA) fen += 'k';
+    if (board.castlePerm & BQCA) fen += 'q';
+    if (board.castlePerm == 0) fen += '-';
+    fen += ' ';
+    if (board.enPas == NO_SQ) {
+        fen += '-';
+    } else {
+        fen += static_cast<char>('a' + BoardFiles[board.enPas]);
+        fen += static_cast<char>('1' + BoardRanks[board.enPas]);
+    }
+    return fen + " " + std::to_string(board.fiftyMove) + " " + std::to_string(board.fullMoveCount);
+}
+
 int SqAttacked(int sq, int side) {
+    ProfileScope<PROF_SQ_ATTACKED> profileScope;
     int piece;
     int t_sq;
     int index;
@@ -668,92 +1150,62 @@ inline int MOVE(int from, int to, int captured, int promoted, int flag) {
 }
 
 void AddCaptureMove(int move) {
-    board.moveList[board.moveListStart[board.ply + 1]] = move;
-    board.moveScores[board.moveListStart[board.ply + 1]++] = MostValubleVictimLeastValuableAttackerScores[CAPTURED(move) * 14 + board.pieces[FROMSQ(move)]] + 1000000;
+    board.moveList[board.moveListStart[board.ply + 1]].move = move;
+    board.moveList[board.moveListStart[board.ply + 1]++].score = MostValubleVictimLeastValuableAttackerScores[CAPTURED(move) * 14 + board.pieces[FROMSQ(move)]] + 1000000;
+}
+
+inline int ContinuationIndex(int piece, int move) {
+    return piece * 64 + SQ64(TOSQ(move));
+}
+
+// The history row of the move played pliesBack plies ago, or nullptr before the first move of the game. Moves
+// played before a null move belong to the other side's line and give no row either.
+int16_t* ContinuationRow(int pliesBack) {
+    if (board.continuationHistory == nullptr || board.hisPly - pliesBack < board.nullHisPly) return nullptr;
+    const Board::HistoryEntry& entry = board.history[board.hisPly - pliesBack];
+    return board.continuationHistory + ContinuationIndex(entry.movedPiece, entry.move) * CONTINUATION_SIZE;
 }
 
 void AddQuietMove(int move) {
-    board.moveList[board.moveListStart[board.ply + 1]] = move;
+    board.moveList[board.moveListStart[board.ply + 1]].move = move;
     
     if (board.searchKillers[board.ply] == move) {
-        board.moveScores[board.moveListStart[board.ply + 1]] = 900000;
+        board.moveList[board.moveListStart[board.ply + 1]].score = 900000;
     } else if (board.searchKillers[MAX_DEPTH + board.ply] == move) {
-        board.moveScores[board.moveListStart[board.ply + 1]] = 800000;
+        board.moveList[board.moveListStart[board.ply + 1]].score = 800000;
+    } else if (board.counterMove == move) {
+        board.moveList[board.moveListStart[board.ply + 1]].score = 700000;
     } else {
-        board.moveScores[board.moveListStart[board.ply + 1]] = board.searchHistory[board.pieces[FROMSQ(move)] * BOARD_SQUARES_NUMBER + TOSQ(move)];
+        int piece = board.pieces[FROMSQ(move)];
+        int index = ContinuationIndex(piece, move);
+        int score = QUIET_SCORE_BASE + board.searchHistory[piece * BOARD_SQUARES_NUMBER + TOSQ(move)];
+        if (board.continuationRows[0] != nullptr) score += board.continuationRows[0][index];
+        if (board.continuationRows[1] != nullptr) score += board.continuationRows[1][index];
+        board.moveList[board.moveListStart[board.ply + 1]].score = score;
     }
     board.moveListStart[board.ply + 1]++;
 }
 
 void AddEnPassantMove(int move) {
-    board.moveList[board.moveListStart[board.ply + 1]] = move;
-    board.moveScores[board.moveListStart[board.ply + 1]++] = 105 + 1000000;
-}
-
-void AddWhitePawnCaptureMove(int from, int to, int cap) {
-    if (BoardRanks[from] == RANK_7) {
-        AddCaptureMove(MOVE(from, to, cap, WHITE_QUEEN, 0));
-        AddCaptureMove(MOVE(from, to, cap, WHITE_ROOK, 0));
-        AddCaptureMove(MOVE(from, to, cap, WHITE_BISHOP, 0));
-        AddCaptureMove(MOVE(from, to, cap, WHITE_KNIGHT, 0));
-    } else {
-        AddCaptureMove(MOVE(from, to, cap, EMPTY, 0));
-    }
-}
-
-void AddWhitePawnQuietMove(int from, int to) {
-    if (BoardRanks[from] == RANK_7) {
-        AddQuietMove(MOVE(from, to, EMPTY, WHITE_QUEEN, 0));
-        AddQuietMove(MOVE(from, to, EMPTY, WHITE_ROOK, 0));
-        AddQuietMove(MOVE(from, to, EMPTY, WHITE_BISHOP, 0));
-        AddQuietMove(MOVE(from, to, EMPTY, WHITE_KNIGHT, 0));
-    } else {
-        AddQuietMove(MOVE(from, to, EMPTY, EMPTY, 0));
-    }
-}
-
-void AddBlackPawnCaptureMove(int from, int to, int cap) {
-    if (BoardRanks[from] == RANK_2) {
-        AddCaptureMove(MOVE(from, to, cap, BLACK_QUEEN, 0));
-        AddCaptureMove(MOVE(from, to, cap, BLACK_ROOK, 0));
-        AddCaptureMove(MOVE(from, to, cap, BLACK_BISHOP, 0));
-        AddCaptureMove(MOVE(from, to, cap, BLACK_KNIGHT, 0));
-    } else {
-        AddCaptureMove(MOVE(from, to, cap, EMPTY, 0));
-    }
-}
-
-void AddBlackPawnQuietMove(int from, int to) {
-    if (BoardRanks[from] == RANK_2) {
-        AddQuietMove(MOVE(from, to, EMPTY, BLACK_QUEEN, 0));
-        AddQuietMove(MOVE(from, to, EMPTY, BLACK_ROOK, 0));
-        AddQuietMove(MOVE(from, to, EMPTY, BLACK_BISHOP, 0));
-        AddQuietMove(MOVE(from, to, EMPTY, BLACK_KNIGHT, 0));
-    } else {
-        AddQuietMove(MOVE(from, to, EMPTY, EMPTY, 0));
-    }
+    board.moveList[board.moveListStart[board.ply + 1]].move = move;
+    board.moveList[board.moveListStart[board.ply + 1]++].score = 105 + 1000000;
 }
 
+// The last piece of the list takes the removed piece's slot
 void ClearPiece(int sq) {
     int piece = board.pieces[sq];
     int col = PieceCol[piece];
-    int index = 0;
-    int t_pieceNum = -1;
+    int t_pieceNum = board.pListIndex[sq];
     
     HASH_PCE(piece, sq);
     
     board.pieces[sq] = EMPTY;
     board.material[col] -= PieceVal[piece];
     
-    for (index = 0; index < board.pieceNum[piece]; ++index) {
-        if (board.pList[PCEINDEX(piece, index)] == sq) {
-            t_pieceNum = index;
-            break;
-        }
-    }
-    
     board.pieceNum[piece]--;
-    board.pList[PCEINDEX(piece, t_pieceNum)] = board.pList[PCEINDEX(piece, board.pieceNum[piece])];
+    int lastSq = board.pList[PCEINDEX(piece, board.pieceNum[piece])];
+    board.pList[PCEINDEX(piece, t_pieceNum)] = lastSq;
+    board.pListIndex[lastSq] = t_pieceNum;
 }
 
 void AddPiece(int sq, int piece) {
@@ -764,13 +1216,12 @@ void AddPiece(int sq, int piece) {
     board.pieces[sq] = piece;
     board.material[col] += PieceVal[piece];
     board.pList[PCEINDEX(piece, board.pieceNum[piece])] = sq;
+    board.pListIndex[sq] = board.pieceNum[piece];
     board.pieceNum[piece]++;
 }
 
 void MovePiece(int from, int to) {
-    int index = 0;
     int piece = board.pieces[from];
-    int col = PieceCol[piece];
     
     HASH_PCE(piece, from);
     board.pieces[from] = EMPTY;
@@ -778,138 +1229,201 @@ void MovePiece(int from, int to) {
     HASH_PCE(piece, to);
     board.pieces[to] = piece;
     
-    for (index = 0; index < board.pieceNum[piece]; ++index) {
-        if (board.pList[PCEINDEX(piece, index)] == from) {
-            board.pList[PCEINDEX(piece, index)] = to;
-            break;
+    int index = board.pListIndex[from];
+    board.pList[PCEINDEX(piece, index)] = to;
+    board.pListIndex[to] = index;
+}
+
+enum GenType {
+    GEN_CAPTURES,       // Captures, capture promotions and en passant
+    GEN_QUIETS,         // Non-captures, including quiet promotions and castling
+    GEN_EVASIONS,       // Moves that may answer a check: king moves, and captures of or blocks against a single checker
+    GEN_QUIET_CHECKS,   // Non-captures that give check, directly or by uncovering a slider
+    GEN_ALL
+};
+
+// Marks the squares a non-king move must reach to answer a check on Color's king: the checker and, for a
+// slider, the squares between it and the king. Returns the number of checkers.
+template <int Color>
+int CheckTargets(uint64_t targets[2]) {
+    constexpr int Them = Color ^ 1;
+    constexpr int PawnLeft = (Color == WHITE) ? 9 : -9;
+    constexpr int PawnRight = (Color == WHITE) ? 11 : -11;
+    constexpr int EnemyPawn = (Color == WHITE) ? BLACK_PAWN : WHITE_PAWN;
+    int kingSq = board.pList[PCEINDEX(KINGS[Color], 0)];
+    int checkers = 0;
+    targets[0] = targets[1] = 0;
+    auto mark = [&](int sq) { targets[sq >> 6] |= 1ULL << (sq & 63); };
+    
+    if (board.pieces[kingSq + PawnLeft] == EnemyPawn) {
+        mark(kingSq + PawnLeft);
+        checkers++;
+    }
+    if (board.pieces[kingSq + PawnRight] == EnemyPawn) {
+        mark(kingSq + PawnRight);
+        checkers++;
+    }
+    for (int dir : KNIGHT_DIRECTIONS) {
+        int piece = board.pieces[kingSq + dir];
+        if (piece != OFFBOARD && PieceKnight[piece] == true && PieceCol[piece] == Them) {
+            mark(kingSq + dir);
+            checkers++;
+        }
+    }
+    for (int index = 0; index < 8; ++index) {
+        int dir = KING_DIRECTIONS[index];
+        int tsq = kingSq + dir;
+        while (board.pieces[tsq] == EMPTY) tsq += dir;
+        int piece = board.pieces[tsq];
+        if (piece == OFFBOARD || PieceCol[piece] != Them) continue;
+        if ((index < 4 && PieceRookQueen[piece] == true) || (index >= 4 && PieceBishopQueen[piece] == true)) {
+            for (int sq = kingSq + dir; sq != tsq + dir; sq += dir) mark(sq);
+            checkers++;
         }
     }
+    return checkers;
 }
 
-void GenerateMoves() {
+// Plays the pseudo-legal quiet move on the square array only and looks for an attack on the enemy king
+template <int Color>
+int QuietMoveGivesCheck(int move) {
+    int from = FROMSQ(move);
+    int to = TOSQ(move);
+    int piece = board.pieces[from];
+    int rookFrom = NO_SQ;
+    int rookTo = NO_SQ;
+    if ((move & MOVE_FLAG_CASTLE) != 0) {
+        rookFrom = (to > from) ? to + 1 : to - 2;
+        rookTo = (to > from) ? to - 1 : to + 1;
+    }
+    
+    board.pieces[from] = EMPTY;
+    board.pieces[to] = (PROMOTED(move) != EMPTY) ? PROMOTED(move) : piece;
+    if (rookFrom != NO_SQ) {
+        board.pieces[rookTo] = board.pieces[rookFrom];
+        board.pieces[rookFrom] = EMPTY;
+    }
+    int check = SqAttacked(board.pList[PCEINDEX(KINGS[Color ^ 1], 0)], Color);
+    if (rookFrom != NO_SQ) {
+        board.pieces[rookFrom] = board.pieces[rookTo];
+        board.pieces[rookTo] = EMPTY;
+    }
+    board.pieces[to] = EMPTY;
+    board.pieces[from] = piece;
+    return check;
+}
+
+// Generates one class of pseudo-legal moves for one side, with the side's directions and ranks known at compile time
+template <int Color, GenType Type>
+void Generate() {
+    constexpr int Them = Color ^ 1;
+    constexpr int Up = (Color == WHITE) ? 10 : -10;
+    constexpr int PawnLeft = (Color == WHITE) ? 9 : -9;
+    constexpr int PawnRight = (Color == WHITE) ? 11 : -11;
+    constexpr int StartRank = (Color == WHITE) ? RANK_2 : RANK_7;
+    constexpr int PromotionRank = (Color == WHITE) ? RANK_7 : RANK_2;
+    constexpr int Pawn = (Color == WHITE) ? WHITE_PAWN : BLACK_PAWN;
+    constexpr int Promotions[4] = {Pawn + 4, Pawn + 3, Pawn + 2, Pawn + 1};
+    constexpr int BackRank = (Color == WHITE) ? 0 : A8 - A1;
+    constexpr int KingSide = (Color == WHITE) ? WKCA : BKCA;
+    constexpr int QueenSide = (Color == WHITE) ? WQCA : BQCA;
+    constexpr bool Captures = (Type != GEN_QUIETS && Type != GEN_QUIET_CHECKS);
+    constexpr bool Quiets = (Type != GEN_CAPTURES);
+    
     board.moveListStart[board.ply + 1] = board.moveListStart[board.ply];
-    int pieceType;
-    int pieceNum;
-    int pieceIndex;
-    int piece;
-    int sq;
-    int tsq;
-    int index;
-    int dir;
+    if (Quiets) {
+        board.continuationRows[0] = ContinuationRow(1);
+        board.continuationRows[1] = ContinuationRow(2);
+        board.counterMove = board.hisPly > board.nullHisPly ? board.counterMoves[ContinuationIndex(board.history[board.hisPly - 1].movedPiece,
+                                                                                     board.history[board.hisPly - 1].move)] : NO_MOVE;
+    }
     
-    if (board.side == WHITE) {
-        pieceType = WHITE_PAWN;
-        for (pieceNum = 0; pieceNum < board.pieceNum[pieceType]; ++pieceNum) {
-            sq = board.pList[PCEINDEX(pieceType, pieceNum)];
-            if (board.pieces[sq + 10] == EMPTY) {
-                AddWhitePawnQuietMove(sq, sq + 10);
-                if (BoardRanks[sq] == RANK_2 && board.pieces[sq + 20] == EMPTY) {
-                    AddQuietMove(MOVE(sq, (sq + 20), EMPTY, EMPTY, MOVE_FLAG_PAWN_START));
-                }
-            }
-            
-            if (SQOFFBOARD(sq + 9) == false && PieceCol[board.pieces[sq + 9]] == BLACK) {
-                AddWhitePawnCaptureMove(sq, sq + 9, board.pieces[sq + 9]);
-            }
-            if (SQOFFBOARD(sq + 11) == false && PieceCol[board.pieces[sq + 11]] == BLACK) {
-                AddWhitePawnCaptureMove(sq, sq + 11, board.pieces[sq + 11]);
-            }
-            
-            if (board.enPas != NO_SQ) {
-                if (sq + 9 == board.enPas) {
-                    AddEnPassantMove(MOVE(sq, sq + 9, EMPTY, EMPTY, MOVE_FLAG_EN_PASSANT));
-                }
-                if (sq + 11 == board.enPas) {
-                    AddEnPassantMove(MOVE(sq, sq + 11, EMPTY, EMPTY, MOVE_FLAG_EN_PASSANT));
-                }
+    uint64_t targets[2] = {~0ULL, ~0ULL};
+    int checkers = 0;
+    if (Type == GEN_EVASIONS) checkers = CheckTargets<Color>(targets);
+    auto reaches = [&](int sq) {
+        return Type != GEN_EVASIONS || (checkers == 1 && ((targets[sq >> 6] >> (sq & 63)) & 1) != 0);
+    };
+    auto addQuiet = [](int move) {
+        if (Type != GEN_QUIET_CHECKS || QuietMoveGivesCheck<Color>(move)) AddQuietMove(move);
+    };
+    auto addPawnMove = [&](int from, int to, int captured) {
+        if (BoardRanks[from] == PromotionRank) {
+            for (int promoted : Promotions) {
+                if (captured != EMPTY) AddCaptureMove(MOVE(from, to, captured, promoted, 0));
+                else addQuiet(MOVE(from, to, EMPTY, promoted, 0));
             }
+        } else if (captured != EMPTY) {
+            AddCaptureMove(MOVE(from, to, captured, EMPTY, 0));
+        } else {
+            addQuiet(MOVE(from, to, EMPTY, EMPTY, 0));
         }
-        
-        if (board.castlePerm & WKCA) {
-            if (board.pieces[F1] == EMPTY && board.pieces[G1] == EMPTY) {
-                if (SqAttacked(E1, BLACK) == false && SqAttacked(F1, BLACK) == false) {
-                    AddQuietMove(MOVE(E1, G1, EMPTY, EMPTY, MOVE_FLAG_CASTLE));
-                }
+    };
+    
+    for (int pieceNum = 0; pieceNum < board.pieceNum[Pawn]; ++pieceNum) {
+        int sq = board.pList[PCEINDEX(Pawn, pieceNum)];
+        if (Quiets && board.pieces[sq + Up] == EMPTY) {
+            if (reaches(sq + Up)) addPawnMove(sq, sq + Up, EMPTY);
+            if (BoardRanks[sq] == StartRank && board.pieces[sq + 2 * Up] == EMPTY && reaches(sq + 2 * Up)) {
+                addQuiet(MOVE(sq, sq + 2 * Up, EMPTY, EMPTY, MOVE_FLAG_PAWN_START));
             }
         }
+        if (!Captures) continue;
         
-        if (board.castlePerm & WQCA) {
-            if (board.pieces[D1] == EMPTY && board.pieces[C1] == EMPTY && board.pieces[B1] == EMPTY) {
-                if (SqAttacked(E1, BLACK) == false && SqAttacked(D1, BLACK) == false) {
-                    AddQuietMove(MOVE(E1, C1, EMPTY, EMPTY, MOVE_FLAG_CASTLE));
-                }
-            }
+        if (SQOFFBOARD(sq + PawnLeft) == false && PieceCol[board.pieces[sq + PawnLeft]] == Them && reaches(sq + PawnLeft)) {
+            addPawnMove(sq, sq + PawnLeft, board.pieces[sq + PawnLeft]);
+        }
+        if (SQOFFBOARD(sq + PawnRight) == false && PieceCol[board.pieces[sq + PawnRight]] == Them && reaches(sq + PawnRight)) {
+            addPawnMove(sq, sq + PawnRight, board.pieces[sq + PawnRight]);
         }
         
-        pieceType = WHITE_KNIGHT;
-        
-    } else {
-        pieceType = BLACK_PAWN;
-        for (pieceNum = 0; pieceNum < board.pieceNum[pieceType]; ++pieceNum) {
-            sq = board.pList[PCEINDEX(pieceType, pieceNum)];
-            
-            if (board.pieces[sq - 10] == EMPTY) {
-                AddBlackPawnQuietMove(sq, sq - 10);
-                if (BoardRanks[sq] == RANK_7 && board.pieces[sq - 20] == EMPTY) {
-                    AddQuietMove(MOVE(sq, (sq - 20), EMPTY, EMPTY, MOVE_FLAG_PAWN_START));
-                }
-            }
-            
-            if (SQOFFBOARD(sq - 9) == false && PieceCol[board.pieces[sq - 9]] == WHITE) {
-                AddBlackPawnCaptureMove(sq, sq - 9, board.pieces[sq - 9]);
-            }
-            
-            if (SQOFFBOARD(sq - 11) == false && PieceCol[board.pieces[sq - 11]] == WHITE) {
-                AddBlackPawnCaptureMove(sq, sq - 11, board.pieces[sq - 11]);
+        // An en passant capture answers a check by taking the checking pawn or by landing on the checking line
+        if (board.enPas != NO_SQ) {
+            if (sq + PawnLeft == board.enPas && (reaches(board.enPas) || reaches(board.enPas - Up))) {
+                AddEnPassantMove(MOVE(sq, sq + PawnLeft, EMPTY, EMPTY, MOVE_FLAG_EN_PASSANT));
             }
-            
-            if (board.enPas != NO_SQ) {
-                if (sq - 9 == board.enPas) {
-                    AddEnPassantMove(MOVE(sq, sq - 9, EMPTY, EMPTY, MOVE_FLAG_EN_PASSANT));
-                }
-                if (sq - 11 == board.enPas) {
-                    AddEnPassantMove(MOVE(sq, sq - 11, EMPTY, EMPTY, MOVE_FLAG_EN_PASSANT));
-                }
+            if (sq + PawnRight == board.enPas && (reaches(board.enPas) || reaches(board.enPas - Up))) {
+                AddEnPassantMove(MOVE(sq, sq + PawnRight, EMPTY, EMPTY, MOVE_FLAG_EN_PASSANT));
             }
         }
-        
-        if (board.castlePerm & BKCA) {
-            if (board.pieces[F8] == EMPTY && board.pieces[G8] == EMPTY) {
-                if (SqAttacked(E8, WHITE) == false && SqAttacked(F8, WHITE) == false) {
-                    AddQuietMove(MOVE(E8, G8, EMPTY, EMPTY, MOVE_FLAG_CASTLE));
+    }
+    
+    if (Quiets && Type != GEN_EVASIONS) {
+        if (board.castlePerm & KingSide) {
+            if (board.pieces[F1 + BackRank] == EMPTY && board.pieces[G1 + BackRank] == EMPTY) {
+                if (SqAttacked(E1 + BackRank, Them) == false && SqAttacked(F1 + BackRank, Them) == false) {
+                    addQuiet(MOVE(E1 + BackRank, G1 + BackRank, EMPTY, EMPTY, MOVE_FLAG_CASTLE));
                 }
             }
         }
         
-        if (board.castlePerm & BQCA) {
-            if (board.pieces[D8] == EMPTY && board.pieces[C8] == EMPTY && board.pieces[B8] == EMPTY) {
-                if (SqAttacked(E8, WHITE) == false && SqAttacked(D8, WHITE) == false) {
-                    AddQuietMove(MOVE(E8, C8, EMPTY, EMPTY, MOVE_FLAG_CASTLE));
+        if (board.castlePerm & QueenSide) {
+            if (board.pieces[D1 + BackRank] == EMPTY && board.pieces[C1 + BackRank] == EMPTY && board.pieces[B1 + BackRank] == EMPTY) {
+                if (SqAttacked(E1 + BackRank, Them) == false && SqAttacked(D1 + BackRank, Them) == false) {
+                    addQuiet(MOVE(E1 + BackRank, C1 + BackRank, EMPTY, EMPTY, MOVE_FLAG_CASTLE));
                 }
             }
         }
-        
-        pieceType = BLACK_KNIGHT;
     }
     
-    pieceIndex = LoopSlideIndex[board.side];
-    piece = LoopSlidePiece[pieceIndex++];
+    int pieceIndex = LoopSlideIndex[Color];
+    int piece = LoopSlidePiece[pieceIndex++];
     while (piece != 0) {
-        for (pieceNum = 0; pieceNum < board.pieceNum[piece]; ++pieceNum) {
-            sq = board.pList[PCEINDEX(piece, pieceNum)];
+        for (int pieceNum = 0; pieceNum < board.pieceNum[piece]; ++pieceNum) {
+            int sq = board.pList[PCEINDEX(piece, pieceNum)];
             
-            for (index = 0; index < DirNum[piece]; ++index) {
-                dir = PieceDir[piece][index];
-                tsq = sq + dir;
+            for (int index = 0; index < DirNum[piece]; ++index) {
+                int dir = PieceDir[piece][index];
+                int tsq = sq + dir;
                 
                 while (SQOFFBOARD(tsq) == false) {
                     if (board.pieces[tsq] != EMPTY) {
-                        if (PieceCol[board.pieces[tsq]] == board.side ^ 1) {
+                        if (Captures && PieceCol[board.pieces[tsq]] == Them && reaches(tsq)) {
                             AddCaptureMove(MOVE(sq, tsq, board.pieces[tsq], EMPTY, 0));
                         }
                         break;
                     }
-                    AddQuietMove(MOVE(sq, tsq, EMPTY, EMPTY, 0));
+                    if (Quiets && reaches(tsq)) addQuiet(MOVE(sq, tsq, EMPTY, EMPTY, 0));
                     tsq += dir;
                 }
             }
@@ -917,147 +1431,54 @@ void GenerateMoves() {
         piece = LoopSlidePiece[pieceIndex++];
     }
     
-    pieceIndex = LoopNonSlideIndex[board.side];
+    pieceIndex = LoopNonSlideIndex[Color];
     piece = LoopNonSlidePiece[pieceIndex++];
-    
     while (piece != 0) {
-        for (pieceNum = 0; pieceNum < board.pieceNum[piece]; ++pieceNum) {
-            sq = board.pList[PCEINDEX(piece, pieceNum)];
+        int king = PieceKing[piece];
+        for (int pieceNum = 0; pieceNum < board.pieceNum[piece]; ++pieceNum) {
+            int sq = board.pList[PCEINDEX(piece, pieceNum)];
             
-            for (index = 0; index < DirNum[piece]; ++index) {
-                dir = PieceDir[piece][index];
-                tsq = sq + dir;
+            for (int index = 0; index < DirNum[piece]; ++index) {
+                int tsq = sq + PieceDir[piece][index];
                 
-                if (SQOFFBOARD(tsq) == true) {
+                if (SQOFFBOARD(tsq) == true || (!king && !reaches(tsq))) {
                     continue;
                 }
                 
                 if (board.pieces[tsq] != EMPTY) {
-                    if (PieceCol[board.pieces[tsq]] == board.side ^ 1) {
+                    if (Captures && PieceCol[board.pieces[tsq]] == Them) {
                         AddCaptureMove(MOVE(sq, tsq, board.pieces[tsq], EMPTY, 0));
                     }
                     continue;
                 }
-                AddQuietMove(MOVE(sq, tsq, EMPTY, EMPTY, 0));
+                if (Quiets) addQuiet(MOVE(sq, tsq, EMPTY, EMPTY, 0));
             }
         }
         piece = LoopNonSlidePiece[pieceIndex++];
     }
 }
 
-void GenerateCaptures() {
-    board.moveListStart[board.ply + 1] = board.moveListStart[board.ply];
-    int pieceType;
-    int pieceNum;
-    int pieceIndex;
-    int piece;
-    int sq;
-    int tsq;
-    int index;
-    int dir;
-    
+// Picks the side once per call; the generators themselves never look at board.side
+template <GenType Type>
+void GenerateMoves() {
+    ProfileScope<Type == GEN_CAPTURES ? PROF_GENERATE_CAPTURES : PROF_GENERATE_MOVES> profileScope;
     if (board.side == WHITE) {
-        pieceType = WHITE_PAWN;
-        for (pieceNum = 0; pieceNum < board.pieceNum[pieceType]; ++pieceNum) {
-            sq = board.pList[PCEINDEX(pieceType, pieceNum)];
-            
-            if (SQOFFBOARD(sq + 9) == false && PieceCol[board.pieces[sq + 9]] == BLACK) {
-                AddWhitePawnCaptureMove(sq, sq + 9, board.pieces[sq + 9]);
-            }
-            if (SQOFFBOARD(sq + 11) == false && PieceCol[board.pieces[sq + 11]] == BLACK) {
-                AddWhitePawnCaptureMove(sq, sq + 11, board.pieces[sq + 11]);
-            }
-            
-            if (board.enPas != NO_SQ) {
-                if (sq + 9 == board.enPas) {
-                    AddEnPassantMove(MOVE(sq, sq + 9, EMPTY, EMPTY, MOVE_FLAG_EN_PASSANT));
-                }
-                if (sq + 11 == board.enPas) {
-                    AddEnPassantMove(MOVE(sq, sq + 11, EMPTY, EMPTY, MOVE_FLAG_EN_PASSANT));
-                }
-            }
-        }
-        
-        pieceType = WHITE_KNIGHT;
-        
+        Generate<WHITE, Type>();
     } else {
-        pieceType = BLACK_PAWN;
-        for (pieceNum = 0; pieceNum < board.pieceNum[pieceType]; ++pieceNum) {
-            sq = board.pList[PCEINDEX(pieceType, pieceNum)];
-            
-            if (SQOFFBOARD(sq - 9) == false && PieceCol[board.pieces[sq - 9]] == WHITE) {
-                AddBlackPawnCaptureMove(sq, sq - 9, board.pieces[sq - 9]);
-            }
-            
-            if (SQOFFBOARD(sq - 11) == false && PieceCol[board.pieces[sq - 11]] == WHITE) {
-                AddBlackPawnCaptureMove(sq, sq - 11, board.pieces[sq - 11]);
-            }
-            
-            if (board.enPas != NO_SQ) {
-                if (sq - 9 == board.enPas) {
-                    AddEnPassantMove(MOVE(sq, sq - 9, EMPTY, EMPTY, MOVE_FLAG_EN_PASSANT));
-                }
-                if (sq - 11 == board.enPas) {
-                    AddEnPassantMove(MOVE(sq, sq - 11, EMPTY, EMPTY, MOVE_FLAG_EN_PASSANT));
-                }
-            }
-        }
-        
-        pieceType = BLACK_KNIGHT;
-    }
-    
-    pieceIndex = LoopSlideIndex[board.side];
-    piece = LoopSlidePiece[pieceIndex++];
-    while (piece != 0) {
-        for (pieceNum = 0; pieceNum < board.pieceNum[piece]; ++pieceNum) {
-            sq = board.pList[PCEINDEX(piece, pieceNum)];
-            
-            for (index = 0; index < DirNum[piece]; ++index) {
-                dir = PieceDir[piece][index];
-                tsq = sq + dir;
-                
-                while (SQOFFBOARD(tsq) == false) {
-                    if (board.pieces[tsq] != EMPTY) {
-                        if (PieceCol[board.pieces[tsq]] == board.side ^ 1) {
-                            AddCaptureMove(MOVE(sq, tsq, board.pieces[tsq], EMPTY, 0));
-                        }
-                        break;
-                    }
-                    tsq += dir;
-                }
-            }
-        }
-        piece = LoopSlidePiece[pieceIndex++];
-    }
-    
-    pieceIndex = LoopNonSlideIndex[board.side];
-    piece = LoopNonSlidePiece[pieceIndex++];
-    
-    while (piece != 0) {
-        for (pieceNum = 0; pieceNum < board.pieceNum[piece]; ++pieceNum) {
-            sq = board.pList[PCEINDEX(piece, pieceNum)];
-            
-            for (index = 0; index < DirNum[piece]; ++index) {
-                dir = PieceDir[piece][index];
-                tsq = sq + dir;
-                
-                if (SQOFFBOARD(tsq) == true) {
-                    continue;
-                }
-                
-                if (board.pieces[tsq] != EMPTY) {
-                    if (PieceCol[board.pieces[tsq]] == board.side ^ 1) {
-                        AddCaptureMove(MOVE(sq, tsq, board.pieces[tsq], EMPTY, 0));
-                    }
-                    continue;
-                }
-            }
-        }
-        piece = LoopNonSlidePiece[pieceIndex++];
+        Generate<BLACK, Type>();
     }
 }
 
+void GenerateMoves() {
+    GenerateMoves<GEN_ALL>();
+}
+
+void GenerateCaptures() {
+    GenerateMoves<GEN_CAPTURES>();
+}
+
 void TakeMove() {
+    ProfileScope<PROF_TAKE_MOVE> profileScope;
     board.hisPly--;
     board.ply--;
     
@@ -1109,6 +1530,7 @@ void TakeMove() {
 }
 
 int MakeMove(int move) {
+    ProfileScope<PROF_MAKE_MOVE> profileScope;
     int from = FROMSQ(move);
     int to = TOSQ(move);
     int side = board.side;
@@ -1143,6 +1565,7 @@ int MakeMove(int move) {
     HASH_CA();
     
     board.history[board.hisPly].move = move;
+    board.history[board.hisPly].movedPiece = board.pieces[from];
     board.history[board.hisPly].fiftyMove = board.fiftyMove;
     board.history[board.hisPly].fullMoveCount = board.fullMoveCount;
     board.history[board.hisPly].enPas = board.enPas;
@@ -1249,7 +1672,7 @@ int ParseMove(int from, int to) {
     int found = false;
     
     for (int index = board.moveListStart[board.ply]; index < board.moveListStart[board.ply + 1]; ++index) {
-        Move = board.moveList[index];
+        Move = board.moveList[index].move;
         if (FROMSQ(Move) == from && TOSQ(Move) == to) {
             PromPiece = PROMOTED(Move);
             if (PromPiece != EMPTY) {
@@ -1280,7 +1703,7 @@ int MoveExists(int move) {
     
     int moveFound = NO_MOVE;
     for (int index = board.moveListStart[board.ply]; index < board.moveListStart[board.ply + 1]; ++index) {
-        moveFound = board.moveList[index];
+        moveFound = board.moveList[index].move;
         if (MakeMove(moveFound) == false) {
             continue;
         }
@@ -1292,11 +1715,237 @@ int MoveExists(int move) {
     return false;
 }
 
-int EvalPosition() {
+void GenerateLegalMoves(std::vector<int>& moves) {
+    moves.clear();
+    GenerateMoves();
+    
+    for (int index = board.moveListStart[board.ply]; index < board.moveListStart[board.ply + 1]; ++index) {
+        moves.push_back(board.moveList[index].move);
+    }
+    
+    moves.erase(std::remove_if(moves.begin(), moves.end(), [](int move) {
+        if (MakeMove(move) == false) return true;
+        TakeMove();
+        return false;
+    }), moves.end());
+}
+
+inline int IsLegalMove(int move) {
+    if (MakeMove(move) == false) {
+        return false;
+    }
+    TakeMove();
+    return true;
+}
+
+// Tries moves piece by piece and stops at the first legal one instead of generating the whole list.
+// Castling is skipped, since a legal castle means the king can also legally step towards the rook.
+int HasLegalMove() {
+    int side = board.side;
+    int pawn = (side == WHITE) ? WHITE_PAWN : BLACK_PAWN;
+    int forward = (side == WHITE) ? 10 : -10;
+    int startRank = (side == WHITE) ? RANK_2 : RANK_7;
+    int promotionRank = (side == WHITE) ? RANK_7 : RANK_2;
+    
+    for (int pieceNum = 0; pieceNum < board.pieceNum[pawn]; ++pieceNum) {
+        int sq = board.pList[PCEINDEX(pawn, pieceNum)];
+        int promoted = (BoardRanks[sq] == promotionRank) ? pawn + 4 : EMPTY;
+        
+        if (board.pieces[sq + forward] == EMPTY) {
+            if (IsLegalMove(MOVE(sq, sq + forward, EMPTY, promoted, 0))) return true;
+            if (BoardRanks[sq] == startRank && board.pieces[sq + 2 * forward] == EMPTY &&
+                IsLegalMove(MOVE(sq, sq + 2 * forward, EMPTY, EMPTY, MOVE_FLAG_PAWN_START))) {
+                return true;
+            }
+        }
+        
+        for (int tsq : {sq + forward - 1, sq + forward + 1}) {
+            if (SQOFFBOARD(tsq) == true) continue;
+            int target = board.pieces[tsq];
+            if (target != EMPTY && PieceCol[target] == (side ^ 1)) {
+                if (IsLegalMove(MOVE(sq, tsq, target, promoted, 0))) return true;
+            } else if (tsq == board.enPas) {
+                if (IsLegalMove(MOVE(sq, tsq, EMPTY, EMPTY, MOVE_FLAG_EN_PASSANT))) return true;
+            }
+        }
+    }
+    
+    for (int piece = pawn + 1; piece <= pawn + 5; ++piece) {
+        int slide = PieceRookQueen[piece] || PieceBishopQueen[piece];
+        
+        for (int pieceNum = 0; pieceNum < board.pieceNum[piece]; ++pieceNum) {
+            int sq = board.pList[PCEINDEX(piece, pieceNum)];
+            
+            for (int index = 0; index < DirNum[piece]; ++index) {
+                int dir = PieceDir[piece][index];
+                int tsq = sq + dir;
+                
+                while (SQOFFBOARD(tsq) == false) {
+                    int target = board.pieces[tsq];
+                    if (target != EMPTY) {
+                        if (PieceCol[target] == (side ^ 1) && IsLegalMove(MOVE(sq, tsq, target, EMPTY, 0))) return true;
+                        break;
+                    }
+                    if (IsLegalMove(MOVE(sq, tsq, EMPTY, EMPTY, 0))) return true;
+                    if (!slide) break;
+                    tsq += dir;
+                }
+            }
+        }
+    }
+    return false;
+}
+
+std::string PrMoveSan(int move) {
+    int from = FROMSQ(move);
+    int to = TOSQ(move);
+    int piece = board.pieces[from];
+    std::string san;
+    
+    if ((move & MOVE_FLAG_CASTLE) != 0) {
+        san = (to == G1 || to == G8) ? "O-O" : "O-O-O";
+    } else {
+        int capture = (move & MOVE_FLAG_CAPTURE_MASK) != 0;
+        
+        if (PiecePawn[piece] == true) {
+            if (capture) san += FileChar[BoardFiles[from]];
+        } else {
+            san += static_cast<char>(toupper(PieceChar[piece]));
+            
+            // Only the pseudo-legal moves of the same piece type to the same square need a legality check
+            GenerateMoves();
+            int ambiguous = false;
+            int sameFile = false;
+            int sameRank = false;
+            for (int index = board.moveListStart[board.ply]; index < board.moveListStart[board.ply + 1]; ++index) {
+                int other = board.moveList[index].move;
+                if (other == move || TOSQ(other) != to || board.pieces[FROMSQ(other)] != piece || !IsLegalMove(other)) continue;
+                ambiguous = true;
+                if (BoardFiles[FROMSQ(other)] == BoardFiles[from]) sameFile = true;
+                if (BoardRanks[FROMSQ(other)] == BoardRanks[from]) sameRank = true;
+            }
+            if (ambiguous) {
+                if (!sameFile) {
+                    san += FileChar[BoardFiles[from]];
+                } else if (!sameRank) {
+                    san += RankChar[BoardRanks[from]];
+                } else {
+                    san += FileChar[BoardFiles[from]];
+                    san += RankChar[BoardRanks[from]];
+                }
+            }
+        }
+        
+        if (capture) san += 'x';
+        san += FileChar[BoardFiles[to]];
+        san += RankChar[BoardRanks[to]];
+        
+        if (PROMOTED(move) != EMPTY) {
+            san += '=';
+            san += static_cast<char>(toupper(PieceChar[PROMOTED(move)]));
+        }
+    }
+    
+    if (MakeMove(move)) {
+        if (SqAttacked(board.pList[PCEINDEX(KINGS[board.side], 0)], board.side ^ 1)) {
+            san += HasLegalMove() ? '+' : '#';
+        }
+        TakeMove();
+    }
+    return san;
+}
+
+// Reads the piece, target square, disambiguation and promotion straight from the text and tries only the
+// matching pseudo-legal moves for legality. Coordinate notation is accepted as well.
+int ParseSan(std::string san) {
+    while (!san.empty() && (san.back() == '+' || san.back() == '#' || san.back() == '!' || san.back() == '?')) {
+        san.pop_back();
+    }
+    std::replace(san.begin(), san.end(), '0', 'O');
+    san.erase(std::remove(san.begin(), san.end(), '='), san.end());
+    san.erase(std::remove(san.begin(), san.end(), 'x'), san.end());
+    if (san.size() < 2) return NO_MOVE;
+    
+    int castle = (san == "O-O") ? G1 : (san == "O-O-O") ? C1 : NO_SQ;
+    int coordinate = san.size() >= 4 && SqFromAlg(san.substr(0, 2)) != NO_SQ && SqFromAlg(san.substr(2, 2)) != NO_SQ;
+    int pieceType = WHITE_PAWN;
+    int promoted = EMPTY;
+    int fromFile = -1;
+    int fromRank = -1;
+    int to = NO_SQ;
+    
+    if (castle == NO_SQ && !coordinate) {
+        const char* pieceLetter = strchr("NBRQK", san[0]);
+        size_t begin = 0;
+        if (pieceLetter != nullptr) {
+            pieceType = WHITE_KNIGHT + static_cast<int>(pieceLetter - "NBRQK");
+            begin = 1;
+        }
+        size_t end = san.size();
+        const char* promotionLetter = strchr("NBRQnbrq", san[end - 1]);
+        if (pieceType == WHITE_PAWN && promotionLetter != nullptr && end >= 3 && isdigit(static_cast<unsigned char>(san[end - 2]))) {
+            promoted = WHITE_KNIGHT + static_cast<int>(promotionLetter - "NBRQnbrq") % 4;
+            end--;
+        }
+        if (end < begin + 2) return NO_MOVE;
+        to = SqFromAlg(san.substr(end - 2, 2));
+        if (to == NO_SQ) return NO_MOVE;
+        for (size_t i = begin; i < end - 2; ++i) {
+            if (san[i] >= 'a' && san[i] <= 'h') fromFile = san[i] - 'a';
+            else if (san[i] >= '1' && san[i] <= '8') fromRank = san[i] - '1';
+            else return NO_MOVE;
+        }
+    }
+    
+    GenerateMoves();
+    for (int index = board.moveListStart[board.ply]; index < board.moveListStart[board.ply + 1]; ++index) {
+        int move = board.moveList[index].move;
+        int from = FROMSQ(move);
+        if (coordinate) {
+            if (PrMove(move) != san) continue;
+        } else if (castle != NO_SQ) {
+            if ((move & MOVE_FLAG_CASTLE) == 0 || BoardFiles[TOSQ(move)] != BoardFiles[castle]) continue;
+        } else {
+            int piece = board.pieces[from];
+            int movePromoted = PROMOTED(move);
+            if (TOSQ(move) != to || (move & MOVE_FLAG_CASTLE) != 0) continue;
+            if (piece - (PieceCol[piece] == BLACK ? BLACK_PAWN - WHITE_PAWN : 0) != pieceType) continue;
+            if (fromFile >= 0 && BoardFiles[from] != fromFile) continue;
+            if (fromRank >= 0 && BoardRanks[from] != fromRank) continue;
+            if (movePromoted - (movePromoted != EMPTY && PieceCol[movePromoted] == BLACK ? BLACK_PAWN - WHITE_PAWN : 0) != promoted) continue;
+        }
+        if (IsLegalMove(move)) return move;
+    }
+    return NO_MOVE;
+}
+
+// Discards the parameter usage that EvalTrace records, so the search's evaluation pays nothing for it
+struct NoEvalTrace {
+    void Add(const int*, int) {}
+};
+
+// The coefficient of every parameter in the white-relative score of the evaluated position
+struct EvalTrace {
+    int coefficients[EVAL_PARAM_COUNT];
+    
+    void Add(const int* param, int coefficient) {
+        coefficients[param - EvalParamData(ActiveEvalParams())] += coefficient;
+    }
+};
+
+template <typename Trace>
+inline int EvalTerm(const int& param, int coefficient, Trace& trace) {
+    trace.Add(&param, coefficient);
+    return coefficient * param;
+}
+
+template <typename Trace>
+int EvaluatePosition(Trace& trace) {
+    const EvalParams& params = ActiveEvalParams();
     int piece;
     int pieceNum;
     int sq;
-    int score = board.material[WHITE] - board.material[BLACK];
+    int score = 0;
     int file;
     int rank;
     
@@ -1304,72 +1953,76 @@ int EvalPosition() {
         return 0;
     }
     
+    for (piece = WHITE_PAWN; piece <= WHITE_QUEEN; ++piece) {
+        score += EvalTerm(params.material[piece - WHITE_PAWN], board.pieceNum[piece] - board.pieceNum[piece + BLACK_PAWN - WHITE_PAWN], trace);
+    }
+    
     PawnsInit();
     
     piece = WHITE_PAWN;
     for (pieceNum = 0; pieceNum < board.pieceNum[piece]; ++pieceNum) {
         sq = board.pList[PCEINDEX(piece, pieceNum)];
-        score += PawnTable[SQ64(sq)];
+        score += EvalTerm(params.pawnTable[SQ64(sq)], 1, trace);
         file = BoardFiles[sq] + 1;
         rank = BoardRanks[sq];
         if (PawnRanksWhite[file - 1] == RANK_8 && PawnRanksWhite[file + 1] == RANK_8) {
-            score += PawnIsolated;
+            score += EvalTerm(params.pawnIsolated, 1, trace);
         }
         
         if (PawnRanksBlack[file - 1] <= rank && PawnRanksBlack[file] <= rank && PawnRanksBlack[file + 1] <= rank) {
-            score += PawnPassed[rank];
+            score += EvalTerm(params.pawnPassed[rank], 1, trace);
         }
     }
     
     piece = BLACK_PAWN;
     for (pieceNum = 0; pieceNum < board.pieceNum[piece]; ++pieceNum) {
         sq = board.pList[PCEINDEX(piece, pieceNum)];
-        score -= PawnTable[MIRROR64(SQ64(sq))];
+        score += EvalTerm(params.pawnTable[MIRROR64(SQ64(sq))], -1, trace);
         file = BoardFiles[sq] + 1;
         rank = BoardRanks[sq];
         if (PawnRanksBlack[file - 1] == RANK_1 && PawnRanksBlack[file + 1] == RANK_1) {
-            score -= PawnIsolated;
+            score += EvalTerm(params.pawnIsolated, -1, trace);
         }
         
         if (PawnRanksWhite[file - 1] >= rank && PawnRanksWhite[file] >= rank && PawnRanksWhite[file + 1] >= rank) {
-            score -= PawnPassed[7 - rank];
+            score += EvalTerm(params.pawnPassed[7 - rank], -1, trace);
         }
     }
     
     piece = WHITE_KNIGHT;
     for (pieceNum = 0; pieceNum < board.pieceNum[piece]; ++pieceNum) {
         sq = board.pList[PCEINDEX(piece, pieceNum)];
-        score += KnightTable[SQ64(sq)];
+        score += EvalTerm(params.knightTable[SQ64(sq)], 1, trace);
     }
     
     piece = BLACK_KNIGHT;
     for (pieceNum = 0; pieceNum < board.pieceNum[piece]; ++pieceNum) {
         sq = board.pList[PCEINDEX(piece, pieceNum)];
-        score -= KnightTable[MIRROR64(SQ64(sq))];
+        score += EvalTerm(params.knightTable[MIRROR64(SQ64(sq))], -1, trace);
     }
     
     piece = WHITE_BISHOP;
     for (pieceNum = 0; pieceNum < board.pieceNum[piece]; ++pieceNum) {
         sq = board.pList[PCEINDEX(piece, pieceNum)];
-        score += BishopTable[SQ64(sq)];
+        score += EvalTerm(params.bishopTable[SQ64(sq)], 1, trace);
     }
     
     piece = BLACK_BISHOP;
     for (pieceNum = 0; pieceNum < board.pieceNum[piece]; ++pieceNum) {
         sq = board.pList[PCEINDEX(piece, pieceNum)];
-        score -= BishopTable[MIRROR64(SQ64(sq))];
+        score += EvalTerm(params.bishopTable[MIRROR64(SQ64(sq))], -1, trace);
     }
     
     piece = WHITE_ROOK;
     for (pieceNum = 0; pieceNum < board.pieceNum[piece]; ++pieceNum) {
         sq = board.pList[PCEINDEX(piece, pieceNum)];
-        score += RookTable[SQ64(sq)];
+        score += EvalTerm(params.rookTable[SQ64(sq)], 1, trace);
         file = BoardFiles[sq] + 1;
         if (PawnRanksWhite[file] == RANK_8) {
             if (PawnRanksBlack[file] == RANK_1) {
-                score += ROOK_OPEN_FILE;
+                score += EvalTerm(params.rookOpenFile, 1, trace);
             } else {
-                score += ROOK_SEMI_OPEN_FILE;
+                score += EvalTerm(params.rookSemiOpenFile, 1, trace);
             }
         }
     }
@@ -1377,13 +2030,13 @@ int EvalPosition() {
     piece = BLACK_ROOK;
     for (pieceNum = 0; pieceNum < board.pieceNum[piece]; ++pieceNum) {
         sq = board.pList[PCEINDEX(piece, pieceNum)];
-        score -= RookTable[MIRROR64(SQ64(sq))];
+        score += EvalTerm(params.rookTable[MIRROR64(SQ64(sq))], -1, trace);
         file = BoardFiles[sq] + 1;
         if (PawnRanksBlack[file] == RANK_1) {
             if (PawnRanksWhite[file] == RANK_8) {
-                score -= ROOK_OPEN_FILE;
+                score += EvalTerm(params.rookOpenFile, -1, trace);
             } else {
-                score -= ROOK_SEMI_OPEN_FILE;
+                score += EvalTerm(params.rookSemiOpenFile, -1, trace);
             }
         }
     }
@@ -1391,13 +2044,13 @@ int EvalPosition() {
     piece = WHITE_QUEEN;
     for (pieceNum = 0; pieceNum < board.pieceNum[piece]; ++pieceNum) {
         sq = board.pList[PCEINDEX(piece, pieceNum)];
-        score += RookTable[SQ64(sq)];
+        score += EvalTerm(params.rookTable[SQ64(sq)], 1, trace);
         file = BoardFiles[sq] + 1;
         if (PawnRanksWhite[file] == RANK_8) {
             if (PawnRanksBlack[file] == RANK_1) {
-                score += QUEEN_OPEN_FILE;
+                score += EvalTerm(params.queenOpenFile, 1, trace);
             } else {
-                score += QUEEN_SEMI_OPEN_FILE;
+                score += EvalTerm(params.queenSemiOpenFile, 1, trace);
             }
         }
     }
@@ -1405,13 +2058,13 @@ int EvalPosition() {
     piece = BLACK_QUEEN;
     for (pieceNum = 0; pieceNum < board.pieceNum[piece]; ++pieceNum) {
         sq = board.pList[PCEINDEX(piece, pieceNum)];
-        score -= RookTable[MIRROR64(SQ64(sq))];
+        score += EvalTerm(params.rookTable[MIRROR64(SQ64(sq))], -1, trace);
         file = BoardFiles[sq] + 1;
         if (PawnRanksBlack[file] == RANK_1) {
             if (PawnRanksWhite[file] == RANK_8) {
-                score -= QUEEN_OPEN_FILE;
+                score += EvalTerm(params.queenOpenFile, -1, trace);
             } else {
-                score -= QUEEN_SEMI_OPEN_FILE;
+                score += EvalTerm(params.queenSemiOpenFile, -1, trace);
             }
         }
     }
@@ -1420,22 +2073,22 @@ int EvalPosition() {
     sq = board.pList[PCEINDEX(piece, 0)];
     
     if ((board.material[BLACK] <= ENDGAME_MAT)) {
-        score += KingInEndgame[SQ64(sq)];
+        score += EvalTerm(params.kingEndgame[SQ64(sq)], 1, trace);
     } else {
-        score += KingInOpening[SQ64(sq)];
+        score += EvalTerm(params.kingOpening[SQ64(sq)], 1, trace);
     }
     
     piece = BLACK_KING;
     sq = board.pList[PCEINDEX(piece, 0)];
     
     if ((board.material[WHITE] <= ENDGAME_MAT)) {
-        score -= KingInEndgame[MIRROR64(SQ64(sq))];
+        score += EvalTerm(params.kingEndgame[MIRROR64(SQ64(sq))], -1, trace);
     } else {
-        score -= KingInOpening[MIRROR64(SQ64(sq))];
+        score += EvalTerm(params.kingOpening[MIRROR64(SQ64(sq))], -1, trace);
     }
     
-    if (board.pieceNum[WHITE_BISHOP] >= 2) score += BISHOP_PAIR;
-    if (board.pieceNum[BLACK_BISHOP] >= 2) score -= BISHOP_PAIR;
+    if (board.pieceNum[WHITE_BISHOP] >= 2) score += EvalTerm(params.bishopPair, 1, trace);
+    if (board.pieceNum[BLACK_BISHOP] >= 2) score += EvalTerm(params.bishopPair, -1, trace);
     
     if (board.side == WHITE) {
         return score;
@@ -1444,71 +2097,157 @@ int EvalPosition() {
     }
 }
 
+// Scores king and pawn against king from the bitbase: 0 for a draw, and for a win a score below a new queen
+// that grows as the pawn advances. Returns false for any other material.
+int ProbeKpk(int& score) {
+    if (board.material[WHITE] + board.material[BLACK] != 2 * PieceVal[WHITE_KING] + PieceVal[WHITE_PAWN]) return false;
+    
+    int strong = board.pieceNum[WHITE_PAWN] ? WHITE : BLACK;
+    int pawnPiece = (strong == WHITE) ? WHITE_PAWN : BLACK_PAWN;
+    int whiteKing = SQ64(board.pList[PCEINDEX(KINGS[strong], 0)]);
+    int blackKing = SQ64(board.pList[PCEINDEX(KINGS[strong ^ 1], 0)]);
+    int pawn = SQ64(board.pList[PCEINDEX(pawnPiece, 0)]);
+    int side = board.side;
+    if (pawn / 8 == RANK_1 || pawn / 8 == RANK_8) return false;   // Only reachable from an illegal FEN
+    if (strong == BLACK) {
+        whiteKing ^= 56;
+        blackKing ^= 56;
+        pawn ^= 56;
+        side ^= 1;
+    }
+    if (pawn % 8 >= 4) {
+        whiteKing ^= 7;
+        blackKing ^= 7;
+        pawn ^= 7;
+    }
+    
+    int index = KpkIndex(side, blackKing, whiteKing, pawn);
+    if ((KpkBitbase[index / 64] >> (index % 64) & 1) == 0) {
+        score = 0;
+    } else {
+        score = KPK_WIN_SCORE + KPK_RANK_BONUS * (pawn / 8);
+        if (board.side != strong) score = -score;
+    }
+    return true;
+}
+
+int EvalPosition() {
+    ProfileScope<PROF_EVAL_POSITION> profileScope;
+    int score;
+    if (ProbeKpk(score)) return score;
+    NoEvalTrace trace;
+    return EvaluatePosition(trace);
+}
+
+// Moves are packed into 16 bits as from (6 bits), to (6 bits) and promotion piece (0 none, 1-4 knight to queen),
+// and turned back into full moves by resolving them against the position
+inline uint16_t PackMove(int move) {
+    int promoted = PROMOTED(move);
+    int promotion = 0;
+    if (promoted != EMPTY) {
+        promotion = (promoted >= BLACK_PAWN) ? promoted - BLACK_PAWN : promoted - WHITE_PAWN;
+    }
+    return static_cast<uint16_t>(SQ64(FROMSQ(move)) | (SQ64(TOSQ(move)) << 6) | (promotion << 12));
+}
+
+int UnpackMove(uint16_t packed) {
+    int from = SQ120(packed & 63);
+    int to = SQ120((packed >> 6) & 63);
+    int promotion = (packed >> 12) & 15;
+    int piece = board.pieces[from];
+    if (packed == 0 || piece == EMPTY || promotion > 4) return NO_MOVE;
+    
+    int promoted = EMPTY;
+    if (promotion != 0) promoted = (PieceCol[piece] == WHITE ? WHITE_PAWN : BLACK_PAWN) + promotion;
+    
+    int flag = 0;
+    if (PiecePawn[piece]) {
+        if (to == board.enPas) return MOVE(from, to, EMPTY, EMPTY, MOVE_FLAG_EN_PASSANT);
+        if (std::abs(to - from) == 20) flag = MOVE_FLAG_PAWN_START;
+    } else if (PieceKing[piece] && std::abs(to - from) == 2) {
+        flag = MOVE_FLAG_CASTLE;
+    }
+    return MOVE(from, to, board.pieces[to], promoted, flag);
+}
+
 inline int ProbePvTable() {
-    int index = board.posKey & (MAX_PV_TABLE_ENTRIES - 1);
+    uint32_t data = board.PvTable[static_cast<uint32_t>(board.posKey) & board.PvTableMask].data.load(std::memory_order_relaxed);
     
-    if (board.PvTable[index].posKey == board.posKey) {
-        return board.PvTable[index].move;
+    if ((data >> 16) == (board.posKey >> 48)) {
+        return UnpackMove(static_cast<uint16_t>(data));
     }
     
     return NO_MOVE;
 }
 
-int GetPvLine(int depth) {
+// Follows the PV table from the current position and takes the moves back again afterwards
+int CollectPvLine(int* moves, int depth) {
+    int startPly = board.ply;
     int move = ProbePvTable();
     int count = 0;
     
     while (move != NO_MOVE && count < depth) {
         if (MoveExists(move)) {
             MakeMove(move);
-            board.PvArray[count++] = move;
+            moves[count++] = move;
         } else {
             break;
         }
         move = ProbePvTable();
     }
     
-    while (board.ply > 0) {
+    while (board.ply > startPly) {
         TakeMove();
     }
     return count;
 }
 
-inline void StorePvMove(int move) {
-    int index = board.posKey & (MAX_PV_TABLE_ENTRIES - 1);
+int GetPvLine(int depth) {
+    return CollectPvLine(board.PvArray, depth);
+}
+
+// The index comes from the low 32 bits of the key and the check from its top 16, so they never share a bit
+inline void StorePvEntry(uint64_t posKey, int move) {
+    uint32_t index = static_cast<uint32_t>(posKey) & board.PvTableMask;
     
-    board.PvTable[index].move = move;
-    board.PvTable[index].posKey = board.posKey;
+    board.PvTable[index].data.store((static_cast<uint32_t>(posKey >> 48) << 16) | PackMove(move), std::memory_order_relaxed);
+}
+
+inline void StorePvMove(int move) {
+    StorePvEntry(board.posKey, move);
 }
 
 void CheckUp() {
+    if (pollCallback) pollCallback();
+    if (search.time == -1) return;
     if ((std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count() - search.start) > search.time) {
         search.stop = true;
     }
 }
 
 void PickNextMove(int moveNum) {
+    ProfileScope<PROF_PICK_NEXT_MOVE> profileScope;
     int index = 0;
     int bestScore = 0;
     int bestNum = moveNum;
     
     for (index = moveNum; index < board.moveListStart[board.ply + 1]; ++index) {
-        if (board.moveScores[index] > bestScore) {
-            bestScore = board.moveScores[index];
+        if (board.moveList[index].score > bestScore) {
+            bestScore = board.moveList[index].score;
             bestNum = index;
         }
     }
     
-    int temp = board.moveList[moveNum];
-    board.moveList[moveNum] = board.moveList[bestNum];
-    board.moveList[bestNum] = temp;
+    std::swap(board.moveList[moveNum], board.moveList[bestNum]);
     
-    temp = board.moveScores[moveNum];
-    board.moveScores[moveNum] = board.moveScores[bestNum];
-    board.moveScores[bestNum] = temp;
+    if (TRACE_ENABLED) {
+        trace.frames[board.ply].picked++;
+        trace.frames[board.ply].pickScore = board.moveList[moveNum].score;
+    }
 }
 
 int IsRepetition() {
+    ProfileScope<PROF_IS_REPETITION> profileScope;
     for (int index = board.hisPly - board.fiftyMove; index < board.hisPly - 1; ++index) {
         if (board.posKey == board.history[index].posKey) {
             return true;
@@ -1517,16 +2256,279 @@ int IsRepetition() {
     return false;
 }
 
-inline void ClearPvTable() {
-    for (int index = 0; index < MAX_PV_TABLE_ENTRIES; index++) {
-        board.PvTable[index].move = NO_MOVE;
-        board.PvTable[index].posKey = 0;
+// Tries explicit 2 MB huge pages, then 2 MB aligned memory marked for transparent huge pages.
+// Sets largePages when explicit huge pages were used.
+void* LargePageAlloc(size_t size, int& largePages) {
+    largePages = false;
+#ifndef _WIN32
+    size_t rounded = (size + LARGE_PAGE_SIZE - 1) / LARGE_PAGE_SIZE * LARGE_PAGE_SIZE;
+#ifdef MAP_HUGETLB
+    void* memory = mmap(nullptr, rounded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (memory != MAP_FAILED) {
+        largePages = true;
+        return memory;
+    }
+#endif
+    
+    // Map an extra large page and trim both ends so the table starts on a 2 MB boundary
+    size_t mappedSize = rounded + LARGE_PAGE_SIZE;
+    void* mapped = mmap(nullptr, mappedSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapped == MAP_FAILED) return nullptr;
+    
+    char* raw = static_cast<char*>(mapped);
+    char* aligned = reinterpret_cast<char*>((reinterpret_cast<uintptr_t>(raw) + LARGE_PAGE_SIZE - 1) & ~(LARGE_PAGE_SIZE - 1));
+    if (aligned > raw) munmap(raw, aligned - raw);
+    if (raw + mappedSize > aligned + rounded) munmap(aligned + rounded, raw + mappedSize - (aligned + rounded));
+#ifdef MADV_HUGEPAGE
+    madvise(aligned, rounded, MADV_HUGEPAGE);
+#endif
+    return aligned;
+#elif defined(_MSC_VER)
+    return _aligned_malloc(size, LARGE_PAGE_SIZE);
+#else
+    return std::aligned_alloc(LARGE_PAGE_SIZE, (size + LARGE_PAGE_SIZE - 1) / LARGE_PAGE_SIZE * LARGE_PAGE_SIZE);
+#endif
+}
+
+void LargePageFree(void* memory, size_t size) {
+    if (memory == nullptr) return;
+#ifndef _WIN32
+    munmap(memory, (size + LARGE_PAGE_SIZE - 1) / LARGE_PAGE_SIZE * LARGE_PAGE_SIZE);
+#elif defined(_MSC_VER)
+    _aligned_free(memory);
+#else
+    free(memory);
+#endif
+}
+
+// CPU lists of the NUMA nodes, read from sysfs. Empty unless the machine has more than one node.
+const std::vector<std::vector<int>>& NumaNodes() {
+    static const std::vector<std::vector<int>> nodes = []() {
+        std::vector<std::vector<int>> found;
+        for (int node = 0; ; ++node) {
+            std::ifstream in("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+            if (!in) break;
+            
+            std::vector<int> cpus;
+            std::string range;
+            while (std::getline(in, range, ',')) {
+                int first = 0;
+                int last = 0;
+                int fields = sscanf(range.c_str(), "%d-%d", &first, &last);
+                if (fields < 1) continue;
+                if (fields == 1) last = first;
+                for (int cpu = first; cpu <= last; ++cpu) {
+                    cpus.push_back(cpu);
+                }
+            }
+            if (!cpus.empty()) found.push_back(cpus);
+        }
+        if (found.size() < 2) found.clear();
+        return found;
+    }();
+    return nodes;
+}
+
+thread_local int numaNode = -1;
+std::atomic<int> nextNumaNode(0);
+
+void BindToNumaNode(int node) {
+#ifdef __linux__
+    const std::vector<std::vector<int>>& nodes = NumaNodes();
+    if (node < 0 || node >= static_cast<int>(nodes.size())) return;
+    
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    for (int cpu : nodes[node]) {
+        if (cpu < CPU_SETSIZE) CPU_SET(cpu, &cpus);
+    }
+    if (sched_setaffinity(0, sizeof(cpus), &cpus) == 0) numaNode = node;
+#else
+    (void)node;
+#endif
+}
+
+// Search threads are spread over the NUMA nodes round-robin, and their hash tables are first touched on the same node
+void BindSearchThread() {
+    const std::vector<std::vector<int>>& nodes = NumaNodes();
+    if (!nodes.empty()) BindToNumaNode(nextNumaNode++ % nodes.size());
+}
+
+// Tables hold a power of two entries, at most 2^32 so that every slot can be reached by a 32-bit key
+void UsePvTable(Board::PvEntry* table, size_t entries) {
+    board.PvTable = table;
+    board.PvTableEntries = entries;
+    board.PvTableMask = static_cast<uint32_t>(entries - 1);
+}
+
+void FreePvTable() {
+    LargePageFree(board.PvTable, board.PvTableEntries * sizeof(Board::PvEntry));
+    board.PvTable = nullptr;
+    board.PvTableEntries = 0;
+    board.PvTableMask = 0;
+}
+
+// Releases every table a search thread allocates, before the thread exits
+void FreeSearchTables() {
+    FreePvTable();
+    free(board.continuationHistory);
+    board.continuationHistory = nullptr;
+}
+
+void AllocatePvTable(int megabytes) {
+    size_t entries = 1;
+    while (entries * 2 - 1 <= UINT32_MAX && entries * 2 * sizeof(Board::PvEntry) <= static_cast<size_t>(megabytes) * 1024 * 1024) {
+        entries *= 2;
+    }
+    if (board.PvTable != nullptr && entries == board.PvTableEntries) return;
+    
+    FreePvTable();
+    Board::PvEntry* table = static_cast<Board::PvEntry*>(LargePageAlloc(entries * sizeof(Board::PvEntry), board.PvTableLargePages));
+    if (table == nullptr) {
+        entries = 65536;
+        table = static_cast<Board::PvEntry*>(LargePageAlloc(entries * sizeof(Board::PvEntry), board.PvTableLargePages));
+    }
+    UsePvTable(table, entries);
+}
+
+// Large tables are zeroed by one thread per core of the owner's NUMA node, so their pages get first touched there
+void ClearPvTable() {
+    AllocatePvTable(search.hashMb > 0 ? search.hashMb : DEFAULT_HASH_MB);
+    
+    char* memory = reinterpret_cast<char*>(board.PvTable);
+    size_t bytes = board.PvTableEntries * sizeof(Board::PvEntry);
+    int threads = 1;
+    if (bytes >= PARALLEL_CLEAR_BYTES) {
+        int cores = static_cast<int>(std::thread::hardware_concurrency());
+        threads = (numaNode >= 0) ? static_cast<int>(NumaNodes()[numaNode].size()) : cores;
+    }
+    if (threads <= 1) {
+        memset(memory, 0, bytes);
+        return;
+    }
+    
+    int node = numaNode;
+    size_t chunk = (bytes / threads + LARGE_PAGE_SIZE - 1) / LARGE_PAGE_SIZE * LARGE_PAGE_SIZE;
+    std::vector<std::thread> clearers;
+    for (int i = 0; i < threads; ++i) {
+        size_t begin = std::min(bytes, i * chunk);
+        size_t end = std::min(bytes, begin + chunk);
+        clearers.emplace_back([=]() {
+            if (node >= 0) BindToNumaNode(node);
+            memset(memory + begin, 0, end - begin);
+        });
+    }
+    for (std::thread& t : clearers) {
+        t.join();
+    }
+}
+
+int HashFull() {
+    if (board.PvTable == nullptr) return 0;
+    int used = 0;
+    for (int index = 0; index < 1000; index++) {
+        if ((board.PvTable[index].data.load(std::memory_order_relaxed) & 0xFFFF) != 0) used++;
+    }
+    return used;
+}
+
+double EffectiveBranchingFactor(int depth) {
+    if (depth < 2 || stats.iterationNodes[depth - 1] == 0) return 0.0;
+    return static_cast<double>(stats.iterationNodes[depth]) / stats.iterationNodes[depth - 1];
+}
+
+std::string FormatRatio(long long part, long long whole) {
+    std::ostringstream out;
+    out.setf(std::ios::fixed);
+    out.precision(3);
+    out << (whole > 0 ? static_cast<double>(part) / whole : 0.0);
+    return out.str();
+}
+
+std::string StatsJson() {
+    std::ostringstream json;
+    json.setf(std::ios::fixed);
+    json.precision(3);
+    json << "{\"enabled\":" << (STATS_ENABLED ? "true" : "false");
+    json << ",\"depth\":" << search.completedDepth << ",\"seldepth\":" << search.seldepth;
+    json << ",\"nodes\":" << search.nodes << ",\"qnodes\":" << stats.qnodes;
+    json << ",\"qnodeShare\":" << FormatRatio(stats.qnodes, search.nodes);
+    json << ",\"ebf\":" << EffectiveBranchingFactor(search.completedDepth);
+    json << ",\"fh\":" << search.fh << ",\"fhf\":" << search.fhf;
+    json << ",\"firstMoveCutoffRate\":" << FormatRatio(search.fhf, search.fh);
+    json << ",\"nullTries\":" << stats.nullTries << ",\"nullCutoffs\":" << stats.nullCutoffs;
+    json << ",\"nullSuccessRate\":" << FormatRatio(stats.nullCutoffs, stats.nullTries);
+    json << ",\"hashProbes\":" << stats.hashProbes << ",\"hashHits\":" << stats.hashHits;
+    json << ",\"hashHitRate\":" << FormatRatio(stats.hashHits, stats.hashProbes);
+    json << ",\"hashfull\":" << HashFull();
+    
+    json << ",\"cutoffIndex\":[";
+    for (int i = 0; i < 8; i++) {
+        json << (i > 0 ? "," : "") << stats.cutoffIndex[i];
+    }
+    json << "],\"nodesByPly\":[";
+    int lastPly = search.seldepth;
+    for (int ply = 0; ply <= lastPly; ply++) {
+        json << (ply > 0 ? "," : "") << stats.plyNodes[ply];
+    }
+    json << "],\"iterations\":[";
+    for (int depth = 1; depth <= search.completedDepth; depth++) {
+        json << (depth > 1 ? "," : "") << "{\"depth\":" << depth << ",\"nodes\":" << stats.iterationNodes[depth]
+             << ",\"ebf\":" << EffectiveBranchingFactor(depth) << "}";
+    }
+    json << "]}";
+    return json.str();
+}
+
+inline int TraceMoveKind(int orderScore) {
+    if (orderScore >= 2000000) return TRACE_KIND_HASH;
+    if (orderScore >= 1000000) return TRACE_KIND_CAPTURE;
+    if (orderScore >= 800000) return TRACE_KIND_KILLER;
+    if (orderScore >= 700000) return TRACE_KIND_COUNTER;
+    return TRACE_KIND_QUIET;
+}
+
+inline void TraceCutoff(int legal) {
+    TraceFrame& frame = trace.frames[board.ply];
+    frame.cutoff = legal;
+    frame.cutoffScore = frame.pickScore;
+}
+
+// Records the child the search just returned from, before its move is taken back. The window and score are
+// from the child's side. Aborted searches, plies beyond TraceMaxPly and records over the budget are left out.
+void TraceChild(int alpha, int beta, int depth, int score, long long nodesBefore, int flags) {
+    TraceFrame& frame = trace.frames[board.ply];
+    if (trace.file != nullptr && !search.stop && (trace.maxPly == 0 || board.ply <= trace.maxPly) &&
+        (trace.nodeBudget == 0 || trace.written < trace.nodeBudget)) {
+        if (depth <= 0) flags |= TRACE_QSEARCH;
+        TraceRecord record = {};
+        record.key = static_cast<uint32_t>(board.posKey);
+        record.move = (flags & TRACE_NULL) || board.hisPly == 0 ? NO_MOVE : board.history[board.hisPly - 1].move;
+        record.nodes = static_cast<uint32_t>(std::min(search.nodes - nodesBefore, 0xFFFFFFFFLL));
+        record.alpha = static_cast<int16_t>(std::max(alpha, -INFINITE));
+        record.beta = static_cast<int16_t>(std::min(beta, INFINITE));
+        record.score = static_cast<int16_t>(score);
+        record.ply = static_cast<uint8_t>(board.ply);
+        record.depth = static_cast<int8_t>(std::max(depth, 0));
+        record.iteration = static_cast<uint8_t>(trace.iteration);
+        record.flags = static_cast<uint8_t>(flags | ((frame.cutoff ? TraceMoveKind(frame.cutoffScore) : TRACE_KIND_NONE) << 4));
+        record.cutoff = static_cast<uint8_t>(std::min(frame.cutoff, 255));
+        record.picked = static_cast<uint8_t>(std::min(frame.picked, 255));
+        fwrite(&record, sizeof(record), 1, trace.file);
+        trace.written++;
     }
+    frame = TraceFrame();
 }
 
 int Quiescence(int alpha, int beta) {
-    if ((search.time != -1) && (search.nodes & 0xFFFF) == 0) CheckUp(); // Only check timing every 65536 nodes
+    if ((search.nodes & 0xFFFF) == 0) CheckUp(); // Only check timing every 65536 nodes
     search.nodes++;
+    if (search.nodeLimit != 0 && search.nodes >= search.nodeLimit) search.stop = true;
+    if (board.ply > search.seldepth) search.seldepth = board.ply;
+    if (STATS_ENABLED) {
+        stats.qnodes++;
+        stats.plyNodes[board.ply]++;
+    }
     
     if (IsRepetition() || board.fiftyMove >= 100) {
         return 0;
@@ -1554,11 +2556,15 @@ int Quiescence(int alpha, int beta) {
     int BestMove = NO_MOVE;
     Score = -INFINITE;
     int PvMove = ProbePvTable();
+    if (STATS_ENABLED) {
+        stats.hashProbes++;
+        if (PvMove != NO_MOVE) stats.hashHits++;
+    }
     
     if (PvMove != NO_MOVE) {
         for (MoveNum = board.moveListStart[board.ply]; MoveNum < board.moveListStart[board.ply + 1]; ++MoveNum) {
-            if (board.moveList[MoveNum] == PvMove) {
-                board.moveScores[MoveNum] = 2000000;
+            if (board.moveList[MoveNum].move == PvMove) {
+                board.moveList[MoveNum].score = 2000000;
                 break;
             }
         }
@@ -1567,12 +2573,14 @@ int Quiescence(int alpha, int beta) {
     for (MoveNum = board.moveListStart[board.ply]; MoveNum < board.moveListStart[board.ply + 1]; ++MoveNum) {
         PickNextMove(MoveNum);
         
-        if (MakeMove(board.moveList[MoveNum]) == false) {
+        if (MakeMove(board.moveList[MoveNum].move) == false) {
             continue;
         }
         
         Legal++;
+        long long nodesBefore = search.nodes;
         Score = -Quiescence(-beta, -alpha);
+        if (TRACE_ENABLED) TraceChild(-beta, -alpha, 0, -Score, nodesBefore, TRACE_QSEARCH);
         TakeMove();
         if (search.stop == true) return 0;
         if (Score > alpha) {
@@ -1581,11 +2589,13 @@ int Quiescence(int alpha, int beta) {
                     search.fhf++;
                 }
                 search.fh++;
+                if (STATS_ENABLED) stats.cutoffIndex[std::min(Legal, 8) - 1]++;
+                if (TRACE_ENABLED) TraceCutoff(Legal);
                 
                 return beta;
             }
             alpha = Score;
-            BestMove = board.moveList[MoveNum];
+            BestMove = board.moveList[MoveNum].move;
         }
     }
     
@@ -1596,18 +2606,56 @@ int Quiescence(int alpha, int beta) {
     return alpha;
 }
 
+// Gravity update: entries saturate towards +-HISTORY_MAX instead of growing without bound
+template <typename T>
+inline void AddHistoryBonus(T& entry, int bonus) {
+    entry += bonus - entry * std::abs(bonus) / HISTORY_MAX;
+}
+
+void AddQuietBonus(int move, int bonus) {
+    int piece = board.pieces[FROMSQ(move)];
+    int index = ContinuationIndex(piece, move);
+    AddHistoryBonus(board.searchHistory[piece * BOARD_SQUARES_NUMBER + TOSQ(move)], bonus);
+    for (int pliesBack = 1; pliesBack <= 2; ++pliesBack) {
+        int16_t* row = ContinuationRow(pliesBack);
+        if (row != nullptr) AddHistoryBonus(row[index], bonus);
+    }
+}
+
+// Rewards the quiet move that produced the best score and penalises the quiet moves searched before it
+void UpdateQuietHistory(int bestMove, int depth, const int* quietsTried, int quietCount) {
+    int bonus = std::min(depth * depth * 4, HISTORY_BONUS_MAX);
+    AddQuietBonus(bestMove, bonus);
+    for (int i = 0; i < quietCount; ++i) {
+        if (quietsTried[i] != bestMove) AddQuietBonus(quietsTried[i], -bonus);
+    }
+    if (board.hisPly > board.nullHisPly) {
+        const Board::HistoryEntry& previous = board.history[board.hisPly - 1];
+        board.counterMoves[ContinuationIndex(previous.movedPiece, previous.move)] = bestMove;
+    }
+}
+
 int AlphaBeta(int alpha, int beta, int depth, int DoNull) {
     if (depth <= 0) {
         return Quiescence(alpha, beta);
     }
-    if ((search.time != -1) && (search.nodes & 0xFFFF) == 0) CheckUp(); // Only check timing every 65536 nodes
+    if ((search.nodes & 0xFFFF) == 0) CheckUp(); // Only check timing every 65536 nodes
     
     search.nodes++;
+    if (search.nodeLimit != 0 && search.nodes >= search.nodeLimit) search.stop = true;
+    if (board.ply > search.seldepth) search.seldepth = board.ply;
+    if (STATS_ENABLED) stats.plyNodes[board.ply]++;
     
     if ((IsRepetition() || board.fiftyMove >= 100) && board.ply != 0) {
         return 0;
     }
     
+    // A bitbase draw is exact, so there is nothing left to search. Wins are still searched to push the pawn.
+    int kpkScore;
+    if (ProbeKpk(kpkScore) && kpkScore == 0) {
+        return 0;
+    }
+    
     if (board.ply > MAX_DEPTH - 1) {
         return EvalPosition();
     }
@@ -1628,9 +2676,15 @@ int AlphaBeta(int alpha, int beta, int depth, int DoNull) {
         board.side ^= 1;
         HASH_SIDE();
         board.enPas = NO_SQ;
+        int nullStore = board.nullHisPly;
+        board.nullHisPly = board.hisPly;
         
+        if (STATS_ENABLED) stats.nullTries++;
+        long long nodesBefore = search.nodes;
         Score = -AlphaBeta(-beta, -beta + 1, depth - 4, false);
+        if (TRACE_ENABLED) TraceChild(-beta, -beta + 1, depth - 4, -Score, nodesBefore, TRACE_NULL);
         
+        board.nullHisPly = nullStore;
         board.side ^= 1;
         HASH_SIDE();
         board.enPas = ePStore;
@@ -1638,23 +2692,34 @@ int AlphaBeta(int alpha, int beta, int depth, int DoNull) {
         
         if (search.stop == true) return 0;
         if (Score >= beta) {
+            if (STATS_ENABLED) stats.nullCutoffs++;
             return beta;
         }
     }
     
-    GenerateMoves();
+    if (InCheck == true) {
+        GenerateMoves<GEN_EVASIONS>();
+    } else {
+        GenerateMoves();
+    }
     
     int MoveNum = 0;
     int Legal = 0;
     int OldAlpha = alpha;
     int BestMove = NO_MOVE;
+    int quietsTried[MAX_QUIETS_TRIED];
+    int quietCount = 0;
     Score = -INFINITE;
     int PvMove = ProbePvTable();
+    if (STATS_ENABLED) {
+        stats.hashProbes++;
+        if (PvMove != NO_MOVE) stats.hashHits++;
+    }
     
     if (PvMove != NO_MOVE) {
         for (MoveNum = board.moveListStart[board.ply]; MoveNum < board.moveListStart[board.ply + 1]; ++MoveNum) {
-            if (board.moveList[MoveNum] == PvMove) {
-                board.moveScores[MoveNum] = 2000000;
+            if (board.moveList[MoveNum].move == PvMove) {
+                board.moveList[MoveNum].score = 2000000;
                 break;
             }
         }
@@ -1663,34 +2728,38 @@ int AlphaBeta(int alpha, int beta, int depth, int DoNull) {
     for (MoveNum = board.moveListStart[board.ply]; MoveNum < board.moveListStart[board.ply + 1]; ++MoveNum) {
         PickNextMove(MoveNum);
         
-        if (MakeMove(board.moveList[MoveNum]) == false) {
+        if (MakeMove(board.moveList[MoveNum].move) == false) {
             continue;
         }
         
         Legal++;
+        long long nodesBefore = search.nodes;
         Score = -AlphaBeta(-beta, -alpha, depth - 1, true);
+        if (TRACE_ENABLED) TraceChild(-beta, -alpha, depth - 1, -Score, nodesBefore, 0);
         TakeMove();
         if (search.stop == true) return 0;
         
+        int quiet = (board.moveList[MoveNum].move & MOVE_FLAG_CAPTURE_MASK) == 0;
         if (Score > alpha) {
             if (Score >= beta) {
                 if (Legal == 1) {
                     search.fhf++;
                 }
                 search.fh++;
+                if (STATS_ENABLED) stats.cutoffIndex[std::min(Legal, 8) - 1]++;
+                if (TRACE_ENABLED) TraceCutoff(Legal);
                 
-                if ((board.moveList[MoveNum] & MOVE_FLAG_CAPTURE_MASK) == 0) {
+                if (quiet) {
                     board.searchKillers[MAX_DEPTH + board.ply] = board.searchKillers[board.ply];
-                    board.searchKillers[board.ply] = board.moveList[MoveNum];
+                    board.searchKillers[board.ply] = board.moveList[MoveNum].move;
+                    UpdateQuietHistory(board.moveList[MoveNum].move, depth, quietsTried, quietCount);
                 }
                 return beta;
             }
             alpha = Score;
-            BestMove = board.moveList[MoveNum];
-            if ((BestMove & MOVE_FLAG_CAPTURE_MASK) == 0) {
-                board.searchHistory[board.pieces[FROMSQ(BestMove)] * BOARD_SQUARES_NUMBER + TOSQ(BestMove)] += depth;
-            }
+            BestMove = board.moveList[MoveNum].move;
         }
+        if (quiet && quietCount < MAX_QUIETS_TRIED) quietsTried[quietCount++] = board.moveList[MoveNum].move;
     }
     
     if (Legal == 0) {
@@ -1703,6 +2772,7 @@ int AlphaBeta(int alpha, int beta, int depth, int DoNull) {
     
     if (alpha != OldAlpha) {
         StorePvMove(BestMove);
+        if ((BestMove & MOVE_FLAG_CAPTURE_MASK) == 0) UpdateQuietHistory(BestMove, depth, quietsTried, quietCount);
     }
     
     return alpha;
@@ -1729,92 +2799,327 @@ int DrawMaterial() {
     return true;
 }
 
-void SearchPosition() {
-    std::fill(board.searchHistory, board.searchHistory + 14 * BOARD_SQUARES_NUMBER, 0);
-    std::fill(board.searchKillers, board.searchKillers + 3 * MAX_DEPTH, 0);
-    
-    ClearPvTable();
-    board.ply = 0;
-
-    search.nodes = 0;
-    search.fh = 0;
-    search.fhf = 0;
-    search.start = std::chrono::duration_cast<std::chrono::milliseconds>(
-        std::chrono::steady_clock::now().time_since_epoch()).count();
-    search.stop = false;
-    
-    int bestMove = NO_MOVE;
-    int bestScore = -INFINITE;
+// Builds the root move list in move generator order, restricted to searchmoves if any were given
+void InitRootMoves() {
+    GenerateMoves();
+    search.rootMoveNum = 0;
     
-    // Iterative deepening
-    for (int currentDepth = 1; currentDepth <= search.depth && !search.stop; ++currentDepth) {
-        bestScore = AlphaBeta(-INFINITE, INFINITE, currentDepth, true);
-        if (search.stop) break;
+    for (int MoveNum = board.moveListStart[0]; MoveNum < board.moveListStart[1]; ++MoveNum) {
+        PickNextMove(MoveNum);
+        int move = board.moveList[MoveNum].move;
         
-        int pvNum = GetPvLine(currentDepth); 
-        bestMove = board.PvArray[0];
+        if (search.searchMoveNum > 0 &&
+            std::find(search.searchMoves, search.searchMoves + search.searchMoveNum, move) == search.searchMoves + search.searchMoveNum) {
+            continue;
+        }
+        if (!IsLegalMove(move)) continue;
         
-        long long currentTime = std::chrono::duration_cast<std::chrono::milliseconds>(
-            std::chrono::steady_clock::now().time_since_epoch()).count() - search.start;
-        long long nps = (currentTime > 0) ? (search.nodes * 1000LL / currentTime) : 0;
+        RootMove& rootMove = search.rootMoves[search.rootMoveNum++];
+        rootMove.line.moves[0] = move;
+        rootMove.line.length = 1;
+        rootMove.line.score = -INFINITE;
+        rootMove.line.depth = 0;
+        rootMove.nodes = 0;
+    }
+}
+
+// Moves that scored in the last iteration go first, best first. The rest follow in move generator order,
+// and moves the generator cannot tell apart are ordered by how many nodes it took to refute them.
+void SortRootMoves() {
+    GenerateMoves();
+    int PvMove = ProbePvTable();
+    for (int index = 0; index < search.rootMoveNum; ++index) {
+        RootMove& rootMove = search.rootMoves[index];
+        for (int MoveNum = board.moveListStart[0]; MoveNum < board.moveListStart[1]; ++MoveNum) {
+            if (board.moveList[MoveNum].move == rootMove.line.moves[0]) {
+                rootMove.orderScore = (board.moveList[MoveNum].move == PvMove) ? 2000000 : board.moveList[MoveNum].score;
+                break;
+            }
+        }
+    }
+    
+    std::stable_sort(search.rootMoves, search.rootMoves + search.rootMoveNum, [](const RootMove& a, const RootMove& b) {
+        if (a.line.score != b.line.score) return a.line.score > b.line.score;
+        if (a.orderScore != b.orderScore) return a.orderScore > b.orderScore;
+        return a.nodes > b.nodes;
+    });
+}
+
+// Searches the root moves in SortRootMoves order. Every move is tried against the score of the current
+// multiPv-th best line, so with a single PV this is a plain alpha-beta root. The best lines go to search.lines.
+int SearchRoot(int depth, int multiPv) {
+    int iterationDepth = depth;
+    search.nodes++;
+    if (STATS_ENABLED) stats.plyNodes[0]++;
+    if (TRACE_ENABLED) {
+        trace.iteration = iterationDepth;
+        memset(trace.frames, 0, sizeof(trace.frames));
+    }
+    
+    int InCheck = SqAttacked(board.pList[PCEINDEX(KINGS[board.side], 0)], board.side ^ 1);
+    if (InCheck == true) {
+        depth++;
+    }
+    
+    if (search.rootMoveNum == 0) {
+        search.lines[0].moves[0] = NO_MOVE;
+        search.lines[0].length = 0;
+        search.lines[0].score = InCheck ? -MATE : 0;
+        search.lines[0].depth = iterationDepth;
+        return 1;
+    }
+    
+    SortRootMoves();
+    
+    int topScores[MAX_MULTI_PV];
+    int lineNum = 0;
+    int alpha = -INFINITE;
+    
+    for (int index = 0; index < search.rootMoveNum; ++index) {
+        RootMove& rootMove = search.rootMoves[index];
+        int move = rootMove.line.moves[0];
+        
+        if (!search.quiet) {
+            long long elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count() - search.start;
+            if (elapsed > 3000) {
+                UciOut("info depth " + std::to_string(iterationDepth) + " currmove " + PrMove(move) +
+                       " currmovenumber " + std::to_string(index + 1));
+            }
+        }
         
-        std::string info = "info depth " + std::to_string(currentDepth);
+        long long nodes = search.nodes;
+        MakeMove(move);
+        int Score = -AlphaBeta(-INFINITE, -alpha, depth - 1, true);
+        if (TRACE_ENABLED) TraceChild(-INFINITE, -alpha, depth - 1, -Score, nodes, 0);
+        if (search.stop == true) {
+            TakeMove();
+            return 0;
+        }
+        rootMove.nodes = search.nodes - nodes;
         
-        if (std::abs(bestScore) > MATE - MAX_DEPTH) {
-            int mateIn = (MATE - std::abs(bestScore) + 1) / 2;
-            if (bestScore < 0) mateIn = -mateIn;
-            info += " score mate " + std::to_string(mateIn);
+        if (Score > alpha) {
+            rootMove.line.length = 1 + CollectPvLine(rootMove.line.moves + 1, depth - 1);
+            rootMove.line.score = Score;
+            rootMove.line.depth = iterationDepth;
+            
+            int slot = std::min(lineNum, multiPv - 1);
+            while (slot > 0 && topScores[slot - 1] < Score) {
+                topScores[slot] = topScores[slot - 1];
+                slot--;
+            }
+            topScores[slot] = Score;
+            lineNum = std::min(lineNum + 1, multiPv);
+            if (lineNum == multiPv) alpha = topScores[multiPv - 1];
         } else {
-            info += " score cp " + std::to_string(bestScore);
+            rootMove.line.score = -INFINITE;
+        }
+        TakeMove();
+    }
+    
+    std::stable_sort(search.rootMoves, search.rootMoves + search.rootMoveNum, [](const RootMove& a, const RootMove& b) {
+        return a.line.score > b.line.score;
+    });
+    StorePvMove(search.rootMoves[0].line.moves[0]);
+    
+    for (int index = 0; index < lineNum; ++index) {
+        search.lines[index] = search.rootMoves[index].line;
+    }
+    return lineNum;
+}
+
+// Cluster workers publish the PV table entries along their best lines, which are the deepest entries they have,
+// so the coordinator can hand them to the other workers. The root entry is left out as it differs per worker.
+void ExportPvEntries(int lineNum) {
+    for (int index = 0; index < lineNum; ++index) {
+        const PvLine& line = search.lines[index];
+        int played = 0;
+        
+        for (int ply = 0; ply < line.length; ++ply) {
+            if (ply > 0) {
+                UciOut("info string hashstore " + std::to_string(board.posKey) + " " + std::to_string(line.moves[ply]));
+            }
+            if (!MakeMove(line.moves[ply])) break;
+            played++;
+        }
+        for (; played > 0; --played) {
+            TakeMove();
+        }
+    }
+}
+
+std::string UciScore(int score) {
+    if (std::abs(score) > MATE - MAX_DEPTH) {
+        int mateIn = (MATE - std::abs(score) + 1) / 2;
+        return "mate " + std::to_string(score < 0 ? -mateIn : mateIn);
+    }
+    return "cp " + std::to_string(score);
+}
+
+// Puts a PV from outside this search, such as the analysis cache, into the PV table for move ordering
+void SeedPvTable() {
+    int played = 0;
+    while (played < search.seedLength) {
+        StorePvMove(search.seedMoves[played]);
+        if (!MakeMove(search.seedMoves[played])) break;
+        played++;
+    }
+    for (; played > 0; --played) {
+        TakeMove();
+    }
+    search.seedLength = 0;
+}
+
+// History carries over between searches of one game at half weight; ClearHistoryTables starts afresh
+void AgeHistoryTables() {
+    if (board.continuationHistory == nullptr) {
+        board.continuationHistory = static_cast<int16_t*>(calloc(CONTINUATION_SIZE * CONTINUATION_SIZE, sizeof(int16_t)));
+    }
+    for (int& entry : board.searchHistory) entry /= 2;
+    if (board.continuationHistory != nullptr) {
+        for (int i = 0; i < CONTINUATION_SIZE * CONTINUATION_SIZE; ++i) board.continuationHistory[i] /= 2;
+    }
+}
+
+void ClearHistoryTables() {
+    std::fill(board.searchHistory, board.searchHistory + 14 * BOARD_SQUARES_NUMBER, 0);
+    std::fill(board.searchKillers, board.searchKillers + 3 * MAX_DEPTH, 0);
+    std::fill(board.counterMoves, board.counterMoves + CONTINUATION_SIZE, NO_MOVE);
+    if (board.continuationHistory != nullptr) {
+        std::fill(board.continuationHistory, board.continuationHistory + CONTINUATION_SIZE * CONTINUATION_SIZE, 0);
+    }
+}
+
+void SearchPosition() {
+    // Any table clearing below runs on the search's clock
+    search.start = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+    AgeHistoryTables();
+    std::fill(board.searchKillers, board.searchKillers + 3 * MAX_DEPTH, 0);
+    
+    if (!search.keepHash || board.PvTable == nullptr) ClearPvTable();
+    board.ply = 0;
+    SeedPvTable();
+
+    search.nodes = 0;
+    search.fh = 0;
+    search.fhf = 0;
+    search.seldepth = 0;
+    if (STATS_ENABLED) memset(&stats, 0, sizeof(stats));
+    if (TRACE_ENABLED) trace.written = 0;
+    
+    int bestMove = NO_MOVE;
+    int bestScore = -INFINITE;
+    search.pvNum = 0;
+    search.completedDepth = 0;
+    
+    InitRootMoves();
+    int multiPv = std::max(1, std::min({search.multiPv, search.rootMoveNum, MAX_MULTI_PV}));
+    for (int index = 0; index < MAX_MULTI_PV; ++index) {
+        search.lines[index].depth = 0;
+    }
+    
+    // Iterative deepening
+    for (int currentDepth = 1; currentDepth <= search.depth && !search.stop; ++currentDepth) {
+        int lineNum = SearchRoot(currentDepth, multiPv);
+        if (search.stop) break;
+        std::copy(search.lines[0].moves, search.lines[0].moves + search.lines[0].length, board.PvArray);
+        
+        bestScore = search.lines[0].score;
+        bestMove = search.lines[0].moves[0];
+        search.best = bestMove;
+        search.score = bestScore;
+        search.pvNum = search.lines[0].length;
+        search.completedDepth = currentDepth;
+        if (STATS_ENABLED) {
+            long long previousNodes = 0;
+            for (int depth = 1; depth < currentDepth; depth++) {
+                previousNodes += stats.iterationNodes[depth];
+            }
+            stats.iterationNodes[currentDepth] = search.nodes - previousNodes;
         }
         
-        info += " nodes " + std::to_string(search.nodes);
-        info += " nps " + std::to_string(nps);
-        info += " time " + std::to_string(currentTime);
+        if (clusterWorker && currentDepth >= CLUSTER_SHARE_DEPTH) ExportPvEntries(lineNum);
+        if (iterationCallback) iterationCallback();
+        if (search.quiet) continue;
         
-        info += " pv";
-        for (int i = 0; i < pvNum; i++) {
-            info += " " + PrMove(board.PvArray[i]);
+        long long currentTime = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count() - search.start;
+        long long nps = (currentTime > 0) ? (search.nodes * 1000LL / currentTime) : 0;
+        
+        for (int index = 0; index < lineNum; ++index) {
+            const PvLine& line = search.lines[index];
+            std::string info = "info depth " + std::to_string(currentDepth);
+            info += " seldepth " + std::to_string(search.seldepth);
+            if (multiPv > 1) info += " multipv " + std::to_string(index + 1);
+            
+            info += " score " + UciScore(line.score);
+            
+            info += " nodes " + std::to_string(search.nodes);
+            info += " nps " + std::to_string(nps);
+            info += " hashfull " + std::to_string(HashFull());
+            info += " time " + std::to_string(currentTime);
+            
+            info += " pv";
+            for (int i = 0; i < line.length; i++) {
+                info += " " + PrMove(line.moves[i]);
+            }
+            
+            UciOut(info);
         }
         
-        std::cout << info << std::endl;
+        if (STATS_ENABLED) {
+            std::ostringstream statsInfo;
+            statsInfo.setf(std::ios::fixed);
+            statsInfo.precision(2);
+            statsInfo << "info string ebf " << EffectiveBranchingFactor(currentDepth)
+                      << " fhf " << FormatRatio(search.fhf, search.fh)
+                      << " qnodes " << FormatRatio(stats.qnodes, search.nodes)
+                      << " null " << FormatRatio(stats.nullCutoffs, stats.nullTries)
+                      << " hashhits " << FormatRatio(stats.hashHits, stats.hashProbes);
+            UciOut(statsInfo.str());
+        }
+    }
+    
+    if (bestMove == NO_MOVE) {
+        std::vector<int> moves;
+        GenerateLegalMoves(moves);
+        if (!moves.empty()) bestMove = moves[0];
     }
     
-    std::cout << "bestmove " << PrMove(bestMove) << std::endl;
+    if (TRACE_ENABLED && trace.file != nullptr) fflush(trace.file);
+    if (!search.quiet) {
+        UciOut("bestmove " + PrMove(bestMove));
+    }
     search.best = bestMove;
+    search.score = bestScore;
     search.thinking = false;
 }
 
+// Searches started outside an Engine job also have to clear search.stop themselves
+void SetSearchLimits(int depth, long long time, long long nodes) {
+    search.depth = std::max(1, std::min(depth, MAX_DEPTH));
+    search.time = time;
+    search.nodeLimit = (nodes > 0) ? nodes : 0;
+    search.searchMoveNum = 0;
+    search.seedLength = 0;
+}
+
 void StartSearch(long long time) {
     search.thinking = true;
-    search.depth = MAX_DEPTH;
-    search.time = time;
+    search.stop = false;
+    SetSearchLimits(MAX_DEPTH, time, 0);
 
     SearchPosition();
     MakeMove(search.best);
 }
 
-std::string getGameState(const std::string& fen) {
-    ParseFen(fen);
-    
+std::string BoardGameState() {
     if (board.fiftyMove > 100 || ThreeFoldRep() >= 2 || DrawMaterial() == true) {
         return "draw";
     }
     
-    GenerateMoves();
-    
-    int MoveNum = 0;
-    int found = 0;
-    for (MoveNum = board.moveListStart[board.ply]; MoveNum < board.moveListStart[board.ply + 1]; ++MoveNum) {
-        if (MakeMove(board.moveList[MoveNum]) == false) {
-            continue;
-        }
-        found++;
-        TakeMove();
-        break;
-    }
-    
-    if (found != 0) return "ongoing";
+    if (HasLegalMove()) return "ongoing";
 
     int InCheck = SqAttacked(board.pList[PCEINDEX(KINGS[board.side], 0)], board.side ^ 1);
     if (InCheck == true) {
@@ -1828,6 +3133,11 @@ std::string getGameState(const std::string& fen) {
     }
 }
 
+std::string getGameState(const std::string& fen) {
+    ParseFen(fen);
+    return BoardGameState();
+}
+
 std::string indexToChessNotation(int index) {
     if (index < 0 || index > 63) {
         throw std::runtime_error("Invalid index. Index must be between 0 and 63.");
@@ -1858,181 +3168,3726 @@ void bestMove(const std::string& fen, long long time) {
     StartSearch(time);
 }
 
-void HandleUci() {
-    std::cout << "id name slowfish" << std::endl;
-    std::cout << "uciok" << std::endl;
-}
+struct MappedFile {
+    const char* data;
+    size_t size;
+    std::string buffer;
+};
 
-int ParseUciMove(const std::string& moveStr) {
-    if (moveStr.length() < 4) return NO_MOVE;
+bool MapFile(const std::string& path, MappedFile& file) {
+    file.data = nullptr;
+    file.size = 0;
+#ifndef _WIN32
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return false;
+    }
     
-    if (moveStr == "e1g1" && board.pieces[E1] == WHITE_KING) {
-        return MOVE(E1, G1, EMPTY, EMPTY, MOVE_FLAG_CASTLE);
+    file.size = st.st_size;
+    if (file.size > 0) {
+        void* mapped = mmap(nullptr, file.size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapped == MAP_FAILED) {
+            close(fd);
+            return false;
+        }
+        madvise(mapped, file.size, MADV_SEQUENTIAL);
+        file.data = static_cast<const char*>(mapped);
+    }
+    close(fd);
+    return true;
+#else
+    std::ifstream in(path, std::ios::binary);
+    if (!in) return false;
+    std::ostringstream contents;
+    contents << in.rdbuf();
+    file.buffer = contents.str();
+    file.data = file.buffer.data();
+    file.size = file.buffer.size();
+    return true;
+#endif
+}
+
+void UnmapFile(MappedFile& file) {
+#ifndef _WIN32
+    if (file.data != nullptr && file.size > 0) {
+        munmap(const_cast<char*>(file.data), file.size);
     }
-    if (moveStr == "e1c1" && board.pieces[E1] == WHITE_KING) {
-        return MOVE(E1, C1, EMPTY, EMPTY, MOVE_FLAG_CASTLE);
+#endif
+    file.data = nullptr;
+    file.size = 0;
+    file.buffer.clear();
+}
+
+// Calls handler for every line that starts inside [begin, end), so adjacent chunks never share a line
+template <typename Handler>
+void ForEachLineInChunk(const MappedFile& file, size_t begin, size_t end, Handler handler) {
+    size_t pos = begin;
+    if (pos > 0 && file.data[pos - 1] != '\n') {
+        const char* eol = static_cast<const char*>(memchr(file.data + pos, '\n', file.size - pos));
+        if (eol == nullptr) return;
+        pos = eol - file.data + 1;
     }
-    if (moveStr == "e8g8" && board.pieces[E8] == BLACK_KING) {
-        return MOVE(E8, G8, EMPTY, EMPTY, MOVE_FLAG_CASTLE);
+    
+    while (pos < end && pos < file.size) {
+        const char* eol = static_cast<const char*>(memchr(file.data + pos, '\n', file.size - pos));
+        size_t lineEnd = (eol != nullptr) ? (eol - file.data) : file.size;
+        size_t length = lineEnd - pos;
+        if (length > 0 && file.data[pos + length - 1] == '\r') length--;
+        
+        handler(file.data + pos, length);
+        pos = lineEnd + 1;
     }
-    if (moveStr == "e8c8" && board.pieces[E8] == BLACK_KING) {
-        return MOVE(E8, C8, EMPTY, EMPTY, MOVE_FLAG_CASTLE);
+}
+
+// Splits an EPD or FEN line into a full FEN (adding move counters when missing) and the remaining opcodes
+bool SplitEpdLine(const char* line, size_t length, std::string& fen, std::string& operations) {
+    size_t starts[6];
+    size_t ends[6];
+    size_t pos = 0;
+    int count = 0;
+    
+    while (count < 6) {
+        while (pos < length && (line[pos] == ' ' || line[pos] == '\t')) pos++;
+        if (pos >= length) break;
+        starts[count] = pos;
+        while (pos < length && line[pos] != ' ' && line[pos] != '\t') pos++;
+        ends[count++] = pos;
     }
     
-    int fromFile = moveStr[0] - 'a';
-    int fromRank = moveStr[1] - '1';
-    int toFile = moveStr[2] - 'a';
-    int toRank = moveStr[3] - '1';
+    if (count < 4) return false;
     
-    if (fromFile < 0 || fromFile > 7 || fromRank < 0 || fromRank > 7 ||
-        toFile < 0 || toFile > 7 || toRank < 0 || toRank > 7) {
-        return NO_MOVE;
+    fen.clear();
+    for (int i = 0; i < 4; ++i) {
+        if (i > 0) fen += ' ';
+        fen.append(line + starts[i], ends[i] - starts[i]);
     }
     
-    int from = FR2SQ(fromFile, fromRank);
-    int to = FR2SQ(toFile, toRank);
-
-    int promoted = EMPTY;
-    if (moveStr.length() == 5) {
-        char promChar = moveStr[4];
-        if (board.side == WHITE) {
-            switch (promChar) {
-                case 'q': promoted = WHITE_QUEEN; break;
-                case 'r': promoted = WHITE_ROOK; break;
-                case 'b': promoted = WHITE_BISHOP; break;
-                case 'n': promoted = WHITE_KNIGHT; break;
-            }
-        } else {
-            switch (promChar) {
-                case 'q': promoted = BLACK_QUEEN; break;
-                case 'r': promoted = BLACK_ROOK; break;
-                case 'b': promoted = BLACK_BISHOP; break;
-                case 'n': promoted = BLACK_KNIGHT; break;
+    size_t opStart = ends[3];
+    bool counters = (count == 6);
+    for (int i = 4; i < count && counters; ++i) {
+        for (size_t c = starts[i]; c < ends[i]; ++c) {
+            if (line[c] < '0' || line[c] > '9') {
+                counters = false;
+                break;
             }
         }
     }
     
-    return MOVE(from, to, EMPTY, promoted, 0);
-}
-
-void HandleIsReady() {
-    std::cout << "readyok" << std::endl;
-}
-
-void HandleUciNewGame() {
-    ClearPvTable();
-    std::fill(board.searchHistory, board.searchHistory + 14 * BOARD_SQUARES_NUMBER, 0);
-    std::fill(board.searchKillers, board.searchKillers + 3 * MAX_DEPTH, 0);
-    ParseFen("rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1");
-}
-
-void HandlePosition(const std::string& command) {
-    std::istringstream iss(command);
-    std::string token;
-    iss >> token;
+    if (counters) {
+        fen += ' ';
+        fen.append(line + starts[4], ends[4] - starts[4]);
+        fen += ' ';
+        fen.append(line + starts[5], ends[5] - starts[5]);
+        opStart = ends[5];
+    } else {
+        fen += " 0 1";
+    }
     
-    iss >> token;
-    if (token == "startpos") {
-        ParseFen("rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1");
+    while (opStart < length && (line[opStart] == ' ' || line[opStart] == '\t')) opStart++;
+    operations.assign(line + opStart, length - opStart);
+    return true;
+}
 
-        iss >> token;
-        if (token == "moves") {
-            while (iss >> token) {
-                int move = ParseUciMove(token);
-                if (move != NO_MOVE) {
-                    MakeMove(move);
-                }
+// Returns the operand of an EPD opcode (e.g. "bm" or "id") with surrounding quotes removed
+std::string EpdOperand(const std::string& operations, const std::string& opcode) {
+    size_t pos = 0;
+    
+    while (pos < operations.length()) {
+        while (pos < operations.length() && (operations[pos] == ' ' || operations[pos] == ';')) pos++;
+        size_t end = pos;
+        int quoted = false;
+        while (end < operations.length() && (quoted || operations[end] != ';')) {
+            if (operations[end] == '"') quoted = !quoted;
+            end++;
+        }
+        
+        std::string operation = operations.substr(pos, end - pos);
+        size_t space = operation.find(' ');
+        if (operation.substr(0, space) == opcode) {
+            if (space == std::string::npos) return "";
+            std::string operand = operation.substr(space + 1);
+            operand.erase(0, operand.find_first_not_of(' '));
+            operand.erase(operand.find_last_not_of(' ') + 1);
+            if (operand.length() >= 2 && operand.front() == '"' && operand.back() == '"') {
+                operand = operand.substr(1, operand.length() - 2);
             }
+            return operand;
         }
-    } else if (token == "fen") {
-        std::string fen;
-        std::getline(iss, fen);
+        pos = end + 1;
+    }
+    return "";
+}
 
-        size_t movesPos = fen.find(" moves ");
-        if (movesPos != std::string::npos) {
-            fen = fen.substr(0, movesPos);
+std::string JsonEscape(const std::string& text) {
+    std::string escaped;
+    for (char c : text) {
+        if (c == '"' || c == '\\') {
+            escaped += '\\';
+            escaped += c;
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            escaped += ' ';
+        } else {
+            escaped += c;
         }
+    }
+    return escaped;
+}
 
-        if (!fen.empty() && fen[0] == ' ') {
-            fen = fen.substr(1);
-        }
-        
-        ParseFen(fen);
+void HandleUci() {
+    UciOut("id name slowfish");
+    UciOut("option name AnalysisCache type string default <empty>");
+    UciOut("option name EvalFile type string default <empty>");
+    UciOut("option name Hash type spin default " + std::to_string(DEFAULT_HASH_MB) + " min 1 max " + std::to_string(MAX_HASH_MB));
+    UciOut("option name MateHash type spin default " + std::to_string(DEFAULT_MATE_HASH_MB) + " min 1 max " + std::to_string(MAX_MATE_HASH_MB));
+    UciOut("option name MultiPV type spin default 1 min 1 max " + std::to_string(MAX_MULTI_PV));
+    if (TRACE_ENABLED) {
+        UciOut("option name TraceFile type string default <empty>");
+        UciOut("option name TraceMaxPly type spin default 0 min 0 max " + std::to_string(MAX_DEPTH));
+        UciOut("option name TraceNodes type spin default 0 min 0 max 2000000000");
+    }
+    UciOut("uciok");
+}
 
-        if (movesPos != std::string::npos) {
-            std::string movesPart = command.substr(command.find(" moves ") + 7);
-            std::istringstream movesStream(movesPart);
-            while (movesStream >> token) {
-                int move = ParseUciMove(token);
-                if (move != NO_MOVE) {
-                    MakeMove(move);
-                }
-            }
+// Resolves a UCI move against the generated moves, so the captured piece and the en passant,
+// pawn start and castle flags come from the move generator rather than being guessed
+int ParseUciMove(const std::string& moveStr) {
+    if (moveStr.length() < 4 || moveStr.length() > 5) return NO_MOVE;
+    if (moveStr[0] < 'a' || moveStr[0] > 'h' || moveStr[1] < '1' || moveStr[1] > '8' ||
+        moveStr[2] < 'a' || moveStr[2] > 'h' || moveStr[3] < '1' || moveStr[3] > '8') {
+        return NO_MOVE;
+    }
+    
+    int from = FR2SQ(moveStr[0] - 'a', moveStr[1] - '1');
+    int to = FR2SQ(moveStr[2] - 'a', moveStr[3] - '1');
+    char promChar = moveStr.length() == 5 ? moveStr[4] : 0;
+    
+    GenerateMoves();
+    for (int index = board.moveListStart[board.ply]; index < board.moveListStart[board.ply + 1]; ++index) {
+        int move = board.moveList[index].move;
+        if (FROMSQ(move) != from || TOSQ(move) != to) continue;
+        
+        int promoted = PROMOTED(move);
+        if (promoted != EMPTY) {
+            if (promChar != tolower(PieceChar[promoted])) continue;
+        } else if (promChar != 0) {
+            continue;
         }
+        return IsLegalMove(move) ? move : NO_MOVE;
     }
+    return NO_MOVE;
 }
 
-void StartUciSearch(int depth, int nodes, long long movetime) {
-    search.thinking = true;
-    search.stop = false;
-    search.time = movetime;
-    search.depth = depth;
+enum CACHEBOUND { BOUND_EXACT, BOUND_LOWER, BOUND_UPPER };
 
-    SearchPosition();
-}
+// One entry of the analysis cache file. The file is a 64 byte header followed by these records, and is only
+// ever appended to, so the newest, deepest record for a key wins.
+struct CacheRecord {
+    uint64_t key;
+    int16_t score;
+    uint8_t depth;
+    uint8_t bound;
+    uint8_t pvLength;
+    uint8_t reserved;
+    uint16_t pv[MAX_CACHE_PV];
+    uint16_t check;
+};
+static_assert(sizeof(CacheRecord) == 64, "cache records must stay 64 bytes");
 
-void HandleGo(const std::string& command) {
-    std::istringstream iss(command);
-    std::string token;
-    iss >> token;
+const char CACHE_MAGIC[8] = {'S', 'F', 'C', 'A', 'C', 'H', 'E', '1'};
+const size_t CACHE_HEADER_SIZE = 64;
 
-    int depth = MAX_DEPTH, nodes = -1;
-    long long movetime = -1;
-    while (iss >> token) {
-        if (token == "depth") iss >> depth;
-        if (token == "nodes") iss >> nodes;
-        if (token == "movetime") iss >> movetime;
+uint16_t CacheCheck(const CacheRecord& record) {
+    const unsigned char* bytes = reinterpret_cast<const unsigned char*>(&record);
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < offsetof(CacheRecord, check); ++i) {
+        hash = (hash ^ bytes[i]) * 16777619u;
     }
+    return static_cast<uint16_t>(hash ^ (hash >> 16));
+}
 
-    StartUciSearch(depth, nodes, movetime);
+std::string UnpackCacheMove(uint16_t packed) {
+    int from = packed & 63;
+    int to = (packed >> 6) & 63;
+    int promotion = (packed >> 12) & 15;
+    
+    std::string moveStr;
+    moveStr += static_cast<char>('a' + from % 8);
+    moveStr += static_cast<char>('1' + from / 8);
+    moveStr += static_cast<char>('a' + to % 8);
+    moveStr += static_cast<char>('1' + to / 8);
+    if (promotion >= 1 && promotion <= 4) moveStr += "nbrq"[promotion - 1];
+    return moveStr;
 }
 
-void HandleStop() {
-    search.stop = true;
+struct AnalysisCache {
+    std::string path;
+    int fd = -1;
+    unsigned long long inode = 0;
+    const char* data = nullptr;
+    size_t mappedSize = 0;
+    size_t scanned = 0;
+    std::unordered_map<uint64_t, size_t> index;   // Key to the offset of its best record
+    std::mutex mutex;
+    
+    ~AnalysisCache() {
+#ifndef _WIN32
+        if (data != nullptr) munmap(const_cast<char*>(data), mappedSize);
+        if (fd >= 0) close(fd);
+#endif
+    }
+};
+
+#ifndef _WIN32
+void CloseCacheFile(AnalysisCache& cache) {
+    if (cache.data != nullptr) munmap(const_cast<char*>(cache.data), cache.mappedSize);
+    if (cache.fd >= 0) close(cache.fd);
+    cache.fd = -1;
+    cache.data = nullptr;
+    cache.mappedSize = 0;
+    cache.scanned = CACHE_HEADER_SIZE;
+    cache.index.clear();
 }
 
-void ParseUciCommand(const std::string& command) {
-    std::istringstream iss(command);
-    std::string token;
-    iss >> token;
+bool OpenCacheFile(AnalysisCache& cache) {
+    CloseCacheFile(cache);
+    cache.fd = open(cache.path.c_str(), O_RDWR | O_APPEND | O_CREAT, 0644);
+    if (cache.fd < 0) return false;
+    
+    flock(cache.fd, LOCK_EX);
+    struct stat st;
+    int ok = fstat(cache.fd, &st) == 0;
+    if (ok && st.st_size == 0) {
+        char header[CACHE_HEADER_SIZE] = {};
+        memcpy(header, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+        ok = write(cache.fd, header, sizeof(header)) == static_cast<ssize_t>(sizeof(header));
+    } else if (ok) {
+        char magic[sizeof(CACHE_MAGIC)] = {};
+        ok = pread(cache.fd, magic, sizeof(magic), 0) == static_cast<ssize_t>(sizeof(magic)) &&
+             memcmp(magic, CACHE_MAGIC, sizeof(magic)) == 0;
+    }
+    flock(cache.fd, LOCK_UN);
     
-    if (token == "uci") {
-        HandleUci();
-    } else if (token == "isready") {
-        HandleIsReady();
-    } else if (token == "ucinewgame") {
-        HandleUciNewGame();
-    } else if (token == "position") {
-        HandlePosition(command);
-    } else if (token == "go") {
-        HandleGo(command);
-    } else if (token == "stop") {
-        HandleStop();
-    } else if (token == "quit") {
-        exit(0);
+    if (!ok) {
+        close(cache.fd);
+        cache.fd = -1;
+        return false;
     }
+    cache.inode = st.st_ino;
+    return true;
 }
 
-void UciLoop() {
-    std::string command;
+// Picks up records appended by other writers since the last call, and reopens the file if it was compacted
+void RefreshCache(AnalysisCache& cache) {
+    struct stat st;
+    if (stat(cache.path.c_str(), &st) == 0 && static_cast<unsigned long long>(st.st_ino) != cache.inode) {
+        OpenCacheFile(cache);
+    }
+    if (cache.fd < 0 || fstat(cache.fd, &st) != 0) return;
+    
+    size_t size = static_cast<size_t>(st.st_size);
+    if (size > cache.mappedSize) {
+        if (cache.data != nullptr) munmap(const_cast<char*>(cache.data), cache.mappedSize);
+        void* mapped = mmap(nullptr, size, PROT_READ, MAP_SHARED, cache.fd, 0);
+        cache.data = (mapped == MAP_FAILED) ? nullptr : static_cast<const char*>(mapped);
+        cache.mappedSize = (mapped == MAP_FAILED) ? 0 : size;
+    }
     
-    while (std::getline(std::cin, command)) {
-        ParseUciCommand(command);
+    for (; cache.scanned + sizeof(CacheRecord) <= cache.mappedSize; cache.scanned += sizeof(CacheRecord)) {
+        const CacheRecord* record = reinterpret_cast<const CacheRecord*>(cache.data + cache.scanned);
+        if (record->check != CacheCheck(*record)) continue;
+        
+        auto found = cache.index.find(record->key);
+        if (found == cache.index.end()) {
+            cache.index.emplace(record->key, cache.scanned);
+        } else if (record->depth >= reinterpret_cast<const CacheRecord*>(cache.data + found->second)->depth) {
+            found->second = cache.scanned;
+        }
     }
 }
+#endif
 
-int main() {
-    init();
-    UciLoop();
-    return 0;
-}
\ No newline at end of file
+std::mutex cacheRegistryMutex;
+std::map<std::string, std::weak_ptr<AnalysisCache>> cacheRegistry;
+
+// Every thread that opens the same path shares one cache object
+std::shared_ptr<AnalysisCache> OpenAnalysisCache(const std::string& path) {
+#ifndef _WIN32
+    std::lock_guard<std::mutex> lock(cacheRegistryMutex);
+    std::shared_ptr<AnalysisCache> cache = cacheRegistry[path].lock();
+    if (cache) return cache;
+    
+    cache = std::make_shared<AnalysisCache>();
+    cache->path = path;
+    if (!OpenCacheFile(*cache)) return nullptr;
+    cacheRegistry[path] = cache;
+    return cache;
+#else
+    (void)path;
+    return nullptr;
+#endif
+}
+
+bool ProbeAnalysisCache(AnalysisCache& cache, uint64_t key, CacheRecord& record) {
+#ifndef _WIN32
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    RefreshCache(cache);
+    auto found = cache.index.find(key);
+    if (found == cache.index.end()) return false;
+    record = *reinterpret_cast<const CacheRecord*>(cache.data + found->second);
+    return true;
+#else
+    (void)cache;
+    (void)key;
+    (void)record;
+    return false;
+#endif
+}
+
+void StoreAnalysisCache(AnalysisCache& cache, CacheRecord record) {
+#ifndef _WIN32
+    record.check = CacheCheck(record);
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    
+    // A compaction may have replaced the file since it was opened, in which case the record goes to the new one
+    for (int attempt = 0; attempt < 2 && cache.fd >= 0; ++attempt) {
+        flock(cache.fd, LOCK_EX);
+        struct stat current;
+        struct stat opened;
+        if (stat(cache.path.c_str(), &current) == 0 && fstat(cache.fd, &opened) == 0 && current.st_ino == opened.st_ino) {
+            ssize_t written = write(cache.fd, &record, sizeof(record));
+            (void)written;
+            flock(cache.fd, LOCK_UN);
+            return;
+        }
+        flock(cache.fd, LOCK_UN);
+        OpenCacheFile(cache);
+    }
+#else
+    (void)cache;
+    (void)record;
+#endif
+}
+
+// Turns a cached record into the search result (best move, score and PV), as if the position had just been searched.
+// Fails if the stored best move is not legal here.
+bool LoadCachedResult(const CacheRecord& record) {
+    int length = 0;
+    for (; length < record.pvLength && length < MAX_CACHE_PV; ++length) {
+        int move = ParseUciMove(UnpackCacheMove(record.pv[length]));
+        if (move == NO_MOVE) break;
+        board.PvArray[length] = move;
+        MakeMove(move);
+        board.ply = 0;
+    }
+    for (int ply = 0; ply < length; ++ply) {
+        TakeMove();
+    }
+    board.ply = 0;
+    if (length == 0) return false;
+    
+    search.best = board.PvArray[0];
+    search.score = record.score;
+    search.pvNum = length;
+    search.completedDepth = record.depth;
+    search.nodes = 0;
+    search.start = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+    
+    PvLine& line = search.lines[0];
+    std::copy(board.PvArray, board.PvArray + length, line.moves);
+    line.length = length;
+    line.score = record.score;
+    line.depth = record.depth;
+    return true;
+}
+
+// Seeds the coming search with the cached PV, which SearchPosition puts into the PV table
+void SeedFromCache(const CacheRecord& record) {
+    if (!LoadCachedResult(record)) return;
+    search.seedLength = std::min(search.pvNum, MAX_DEPTH);
+    std::copy(board.PvArray, board.PvArray + search.seedLength, search.seedMoves);
+}
+
+void StoreSearchResult(AnalysisCache& cache, uint64_t key) {
+    if (search.completedDepth == 0 || search.pvNum == 0) return;
+    
+    CacheRecord record;
+    memset(&record, 0, sizeof(record));
+    record.key = key;
+    record.score = static_cast<int16_t>(search.score);
+    record.depth = static_cast<uint8_t>(search.completedDepth);
+    record.bound = BOUND_EXACT;
+    record.pvLength = static_cast<uint8_t>(std::min(search.pvNum, MAX_CACHE_PV));
+    for (int i = 0; i < record.pvLength; ++i) {
+        record.pv[i] = PackMove(board.PvArray[i]);
+    }
+    StoreAnalysisCache(cache, record);
+}
+
+// Looks the current position up before a search of the given depth. Returns true if the cached result is deep
+// enough to be used as it is (already loaded into search), otherwise seeds the search with it.
+bool ProbeBeforeSearch(AnalysisCache& cache, uint64_t key, int depth, int& cachedDepth) {
+    CacheRecord record;
+    cachedDepth = 0;
+    if (!ProbeAnalysisCache(cache, key, record)) return false;
+    
+    cachedDepth = record.depth;
+    if (record.bound == BOUND_EXACT && record.depth >= depth && LoadCachedResult(record)) return true;
+    SeedFromCache(record);
+    return false;
+}
+
+thread_local std::shared_ptr<AnalysisCache> analysisCache;
+
+void HandleIsReady() {
+    UciOut("readyok");
+}
+
+void HandleUciNewGame() {
+    ClearPvTable();
+    ClearHistoryTables();
+    ParseFen("rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1");
+}
+
+// The game set up by the last position command. GUIs resend the whole game before every go,
+// so a command that only appends moves to it is applied incrementally.
+struct UciGame {
+    std::string fen;
+    std::vector<std::string> moves;
+    uint64_t posKey;
+    int hisPly;
+};
+thread_local UciGame uciGame;
+
+void HandlePosition(const std::string& command) {
+    std::istringstream iss(command);
+    std::string token;
+    iss >> token;
+    
+    std::string fen;
+    iss >> token;
+    if (token == "startpos") {
+        fen = "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1";
+        iss >> token;
+    } else if (token == "fen") {
+        while (iss >> token && token != "moves") {
+            if (!fen.empty()) fen += ' ';
+            fen += token;
+        }
+    } else {
+        return;
+    }
+    
+    std::vector<std::string> moves;
+    if (token == "moves") {
+        while (iss >> token) {
+            moves.push_back(token);
+        }
+    }
+    
+    // Reuse the current game only if nothing else has touched the board since it was set up
+    size_t common = 0;
+    if (fen == uciGame.fen && board.posKey == uciGame.posKey && board.hisPly == uciGame.hisPly) {
+        while (common < uciGame.moves.size() && common < moves.size() && uciGame.moves[common] == moves[common]) {
+            common++;
+        }
+        for (size_t index = common; index < uciGame.moves.size(); ++index) {
+            TakeMove();
+        }
+        uciGame.moves.resize(common);
+    } else {
+        ParseFen(fen);
+        uciGame.fen = fen;
+        uciGame.moves.clear();
+    }
+    
+    for (size_t index = common; index < moves.size(); ++index) {
+        int move = ParseUciMove(moves[index]);
+        if (move == NO_MOVE) break;
+        
+        MakeMove(move);
+        uciGame.moves.push_back(moves[index]);
+        board.ply = 0;
+    }
+    board.ply = 0;
+    
+    uciGame.posKey = board.posKey;
+    uciGame.hisPly = board.hisPly;
+}
+
+void PrintProfile() {
+    if (!PROFILE_ENABLED) return;
+    
+    unsigned long long totalCycles = 0;
+    for (int function = 0; function < PROF_COUNT; function++) {
+        totalCycles += profile.cycles[function];
+    }
+    
+    char line[160];
+    snprintf(line, sizeof(line), "info string %-18s %14s %16s %12s", "function", "calls", "cycles", "cycles/call");
+    UciOut(line);
+    for (int function = 0; function < PROF_COUNT; function++) {
+        unsigned long long calls = profile.calls[function];
+        unsigned long long cycles = profile.cycles[function];
+        snprintf(line, sizeof(line), "info string %-18s %14llu %16llu %12.1f", ProfileNames[function], calls, cycles,
+                 calls > 0 ? static_cast<double>(cycles) / calls : 0.0);
+        UciOut(line);
+    }
+    UciOut("info string profile cycles are inclusive of callees, total " + std::to_string(totalCycles));
+}
+
+const char* const BenchPositions[] = {
+    "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1",
+    "7r/p3ppk1/3p4/2p1P1Kp/2Pb4/3P1QPq/PP5P/R6R b - - 0 1",
+    "rn3rk1/p5pp/2p5/3Ppb2/2q5/1Q6/PPPB2PP/R3K1NR b - - 0 1",
+    "3r2k1/p4ppp/b1pb1Q2/q7/8/1B3p2/PBPPNP1P/1R2K1R1 b - - 1 0",
+    "R4r1k/6pp/2pq4/2n2b2/2Q1pP1b/1r2P2B/NP5P/2B2KNR b - - 1 24",
+    "1r4k1/3n1r1p/R3p1p1/2p5/2Q1N3/1q4PP/1b2PPB1/3R2K1 w - - 0 1",
+    "8/8/7k/8/8/8/5q2/3B2RK b - - 0 1"
+};
+
+void HandleBench(const std::string& command) {
+    std::istringstream iss(command);
+    std::string token;
+    int depth = 6;
+    iss >> token;
+    if (iss >> token) depth = std::max(1, std::min(std::atoi(token.c_str()), MAX_DEPTH));
+    
+    memset(&profile, 0, sizeof(profile));
+    long long totalNodes = 0;
+    long long start = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+    
+    for (const char* fen : BenchPositions) {
+        ParseFen(fen);
+        search.quiet = true;
+        search.stop = false;
+        SetSearchLimits(depth, -1, 0);
+        ClearHistoryTables();
+        ClearPvTable();
+        SearchPosition();
+        search.quiet = false;
+        totalNodes += search.nodes;
+        UciOut("info string bench " + std::string(fen) + " nodes " + std::to_string(search.nodes) + " bestmove " + PrMove(search.best));
+    }
+    
+    long long elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count() - start;
+    long long nps = (elapsed > 0) ? (totalNodes * 1000LL / elapsed) : 0;
+    UciOut("info string bench depth " + std::to_string(depth) + " nodes " + std::to_string(totalNodes) +
+           " time " + std::to_string(elapsed) + " nps " + std::to_string(nps));
+    PrintProfile();
+}
+
+// Counts the leaf nodes of the legal move tree, generating evasions in check the same way the search does
+long long Perft(int depth) {
+    if (depth == 0) return 1;
+    if (SqAttacked(board.pList[PCEINDEX(KINGS[board.side], 0)], board.side ^ 1)) {
+        GenerateMoves<GEN_EVASIONS>();
+    } else {
+        GenerateMoves();
+    }
+    
+    long long nodes = 0;
+    for (int index = board.moveListStart[board.ply]; index < board.moveListStart[board.ply + 1]; ++index) {
+        if (MakeMove(board.moveList[index].move) == false) continue;
+        nodes += Perft(depth - 1);
+        TakeMove();
+    }
+    return nodes;
+}
+
+// Prints the perft count below every root move of the current position, then the total
+void HandlePerft(const std::string& command) {
+    std::istringstream iss(command);
+    std::string token;
+    int depth = 5;
+    iss >> token;
+    if (iss >> token) depth = std::max(1, std::min(std::atoi(token.c_str()), MAX_DEPTH - 1));
+    
+    long long start = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+    std::vector<int> moves;
+    GenerateLegalMoves(moves);
+    long long totalNodes = 0;
+    for (int move : moves) {
+        MakeMove(move);
+        long long nodes = Perft(depth - 1);
+        TakeMove();
+        totalNodes += nodes;
+        UciOut("info string perft " + PrMove(move) + " " + std::to_string(nodes));
+    }
+    
+    long long elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count() - start;
+    long long nps = (elapsed > 0) ? (totalNodes * 1000LL / elapsed) : 0;
+    UciOut("info string perft depth " + std::to_string(depth) + " nodes " + std::to_string(totalNodes) +
+           " time " + std::to_string(elapsed) + " nps " + std::to_string(nps));
+}
+
+// Proof-number mate search. Each node stores phi, the cost of proving that the side to move wins, and delta, the cost
+// of proving that it loses. The attacker loses when the plies run out without mate, on stalemate and on repetition.
+struct MateEntry {
+    uint64_t key;
+    uint32_t phi;
+    uint32_t delta;
+    uint32_t work;            // Nodes spent below this entry, so replacement keeps the expensive ones
+    int move;
+};
+
+struct MateChild {
+    int move;
+    uint64_t key;
+    uint32_t phi;
+    uint32_t delta;
+};
+
+thread_local std::vector<MateEntry> mateTable;
+
+// The 64-bit key after move, worked out from the key before it without playing the move
+uint64_t NextPosKey64(uint64_t key, int move) {
+    int from = FROMSQ(move);
+    int to = TOSQ(move);
+    int piece = board.pieces[from];
+    int placed = (PROMOTED(move) != EMPTY) ? PROMOTED(move) : piece;
+    key ^= PieceKeys64[piece * 120 + from] ^ PieceKeys64[placed * 120 + to];
+    
+    if ((move & MOVE_FLAG_EN_PASSANT) != 0) {
+        int capturedSq = (board.side == WHITE) ? to - 10 : to + 10;
+        key ^= PieceKeys64[board.pieces[capturedSq] * 120 + capturedSq];
+    } else if (CAPTURED(move) != EMPTY) {
+        key ^= PieceKeys64[CAPTURED(move) * 120 + to];
+    } else if ((move & MOVE_FLAG_CASTLE) != 0) {
+        int rookFrom = (to > from) ? to + 1 : to - 2;
+        int rookTo = (to > from) ? to - 1 : to + 1;
+        key ^= PieceKeys64[board.pieces[rookFrom] * 120 + rookFrom] ^ PieceKeys64[board.pieces[rookFrom] * 120 + rookTo];
+    }
+    
+    if (board.enPas != NO_SQ) key ^= PieceKeys64[board.enPas];
+    if ((move & MOVE_FLAG_PAWN_START) != 0) key ^= PieceKeys64[(from + to) / 2];
+    key ^= CastleKeys64[board.castlePerm] ^ CastleKeys64[board.castlePerm & CastlePerm[from] & CastlePerm[to]];
+    return key ^ SideKey64;
+}
+
+// Table keys tell apart the same position with different numbers of plies left
+inline uint64_t MateKey(uint64_t positionKey, int plies) {
+    return positionKey ^ (0x9E3779B97F4A7C15ULL * static_cast<uint64_t>(plies + 1));
+}
+
+// Every key may sit in either entry of a pair
+MateEntry* ProbeMateTable(uint64_t key) {
+    size_t index = static_cast<size_t>(key) & (mateTable.size() - 2);
+    if (mateTable[index].key == key) return &mateTable[index];
+    if (mateTable[index + 1].key == key) return &mateTable[index + 1];
+    return nullptr;
+}
+
+void StoreMateTable(uint64_t key, uint32_t phi, uint32_t delta, uint32_t work, int move) {
+    size_t index = static_cast<size_t>(key) & (mateTable.size() - 2);
+    MateEntry* entry = &mateTable[index];
+    if (entry->key != key && (mateTable[index + 1].key == key || mateTable[index + 1].work < entry->work)) entry++;
+    *entry = {key, phi, delta, work, move};
+}
+
+// Fills children with the legal moves worth trying. The attacker's last move has to be a check, so only checks
+// are generated for it. Elsewhere quiet attacking moves start with a higher proof number than checks.
+int GenerateMateChildren(int attacking, int plies, int inCheck, uint64_t positionKey, MateChild* children) {
+    int count = 0;
+    int checksOnly = attacking && plies == 1;
+    auto addLegal = [&]() {
+        for (int index = board.moveListStart[board.ply]; index < board.moveListStart[board.ply + 1]; ++index) {
+            int move = board.moveList[index].move;
+            if (MakeMove(move) == false) continue;
+            int check = SqAttacked(board.pList[PCEINDEX(KINGS[board.side], 0)], board.side ^ 1);
+            if (check || !checksOnly) {
+                children[count++] = {move, 0, 1, (attacking && !check) ? MATE_QUIET_PROOF : 1};
+            }
+            TakeMove();
+        }
+    };
+    
+    if (checksOnly) {
+        GenerateMoves<GEN_CAPTURES>();
+        addLegal();
+        GenerateMoves<GEN_QUIET_CHECKS>();
+        addLegal();
+    } else if (inCheck) {
+        GenerateMoves<GEN_EVASIONS>();
+        addLegal();
+    } else {
+        GenerateMoves();
+        addLegal();
+    }
+    for (int i = 0; i < count; ++i) {
+        children[i].key = NextPosKey64(positionKey, children[i].move);
+    }
+    return count;
+}
+
+// Depth-first proof-number search: expands the most proving child until phi or delta reaches its threshold.
+// Returns the node's final {phi, delta}.
+std::pair<uint32_t, uint32_t> MateSearch(int plies, uint64_t positionKey, uint32_t thresholdPhi, uint32_t thresholdDelta) {
+    if ((search.nodes & 0x3FF) == 0) CheckUp();
+    search.nodes++;
+    if (search.nodeLimit != 0 && search.nodes >= search.nodeLimit) search.stop = true;
+    if (board.ply > search.seldepth) search.seldepth = board.ply;
+    
+    int attacking = (plies % 2) == 1;
+    if (board.ply > 0 && IsRepetition()) {
+        return attacking ? std::make_pair(PN_INFINITE, 0u) : std::make_pair(0u, PN_INFINITE);
+    }
+    
+    MateChild children[MAX_POSITION_MOVES];
+    int inCheck = SqAttacked(board.pList[PCEINDEX(KINGS[board.side], 0)], board.side ^ 1);
+    int count = (plies > 0) ? GenerateMateChildren(attacking, plies, inCheck, positionKey, children) : 0;
+    uint64_t key = MateKey(positionKey, plies);
+    if (count == 0) {
+        int lost = attacking || (inCheck && (plies > 0 || !HasLegalMove()));
+        uint32_t phi = lost ? PN_INFINITE : 0;
+        uint32_t delta = lost ? 0 : PN_INFINITE;
+        StoreMateTable(key, phi, delta, 1, NO_MOVE);
+        return {phi, delta};
+    }
+    for (int i = 0; i < count; ++i) {
+        MateEntry* entry = ProbeMateTable(MateKey(children[i].key, plies - 1));
+        if (entry != nullptr) {
+            children[i].phi = entry->phi;
+            children[i].delta = entry->delta;
+        }
+    }
+    
+    long long startNodes = search.nodes;
+    uint32_t phi = 0;
+    uint32_t delta = 0;
+    int best = 0;
+    while (true) {
+        phi = PN_INFINITE;
+        uint64_t sum = 0;
+        int won = false;
+        uint32_t secondDelta = PN_INFINITE;
+        for (int i = 0; i < count; ++i) {
+            sum += children[i].phi;
+            if (children[i].phi == PN_INFINITE) won = true;
+            if (children[i].delta < phi) {
+                secondDelta = phi;
+                phi = children[i].delta;
+                best = i;
+            } else if (children[i].delta < secondDelta) {
+                secondDelta = children[i].delta;
+            }
+        }
+        // Only a child won for its own side to move makes delta infinite; large sums stop just below
+        delta = won ? PN_INFINITE : static_cast<uint32_t>(std::min<uint64_t>(sum, PN_INFINITE - 1));
+        if (phi >= thresholdPhi || delta >= thresholdDelta || search.stop) break;
+        
+        // The child may use what is left of this node's delta budget, and may not overtake the second best child
+        uint32_t childPhi = thresholdDelta - delta + children[best].phi;
+        uint32_t childDelta = std::min<uint64_t>(thresholdPhi, static_cast<uint64_t>(secondDelta) * 5 / 4 + 1);
+        MakeMove(children[best].move);
+        std::pair<uint32_t, uint32_t> result = MateSearch(plies - 1, children[best].key, childPhi, childDelta);
+        TakeMove();
+        children[best].phi = result.first;
+        children[best].delta = result.second;
+    }
+    
+    if (delta == 0) {
+        uint32_t mostWork = 0;
+        for (int i = 0; i < count; ++i) {
+            MateEntry* entry = ProbeMateTable(MateKey(children[i].key, plies - 1));
+            if (entry != nullptr && entry->work >= mostWork) {
+                mostWork = entry->work;
+                best = i;
+            }
+        }
+    }
+    if (!search.stop) {
+        uint32_t work = static_cast<uint32_t>(std::min<long long>(search.nodes - startNodes, 0xFFFFFFFF));
+        StoreMateTable(key, phi, delta, work, children[best].move);
+    }
+    return {phi, delta};
+}
+
+// Follows the stored moves of a proven position: the mating move for the attacker, the most stubborn reply for the defender
+std::vector<int> MatePv(int plies) {
+    std::vector<int> pv;
+    while (plies > 0) {
+        MateEntry* entry = ProbeMateTable(MateKey(GeneratePosKey64(), plies));
+        if (entry == nullptr || entry->move == NO_MOVE || MakeMove(entry->move) == false) break;
+        pv.push_back(entry->move);
+        plies--;
+    }
+    for (size_t i = 0; i < pv.size(); ++i) {
+        TakeMove();
+    }
+    return pv;
+}
+
+// Proves a mate of at most moves moves, then lowers the limit one move at a time until the shorter mate is refuted
+// or time runs out. Falls back to the normal search when no mate is proven.
+// A table larger than the machine can provide is halved until it fits, as the main hash falls back to a small table
+void AllocateMateTable(int megabytes) {
+    size_t entries = 2;
+    size_t bytes = static_cast<size_t>(megabytes) * 1024 * 1024;
+    while (entries * 2 * sizeof(MateEntry) <= bytes) entries *= 2;
+    for (;;) {
+        try {
+            mateTable.assign(entries, MateEntry());
+            return;
+        } catch (const std::bad_alloc&) {
+            mateTable.clear();
+            mateTable.shrink_to_fit();
+            if (entries <= 65536) throw;
+            entries /= 2;
+        }
+    }
+}
+
+void StartMateSearch(int moves, long long nodes, long long movetime) {
+    search.thinking = true;
+    SetSearchLimits(MAX_DEPTH, movetime, nodes);
+    search.nodes = 0;
+    search.seldepth = 0;
+    search.start = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+    board.ply = 0;
+    
+    AllocateMateTable(search.mateHashMb > 0 ? search.mateHashMb : DEFAULT_MATE_HASH_MB);
+    
+    moves = std::max(1, std::min(moves, MAX_DEPTH / 2));
+    int proven = 0;
+    int disproven = false;
+    for (int length = moves; length >= 1 && !search.stop; --length) {
+        std::pair<uint32_t, uint32_t> result = MateSearch(2 * length - 1, GeneratePosKey64(), PN_INFINITE, PN_INFINITE);
+        if (result.first != 0) {
+            disproven = (result.second == 0);
+            break;
+        }
+        proven = length;
+    }
+    
+    long long elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count() - search.start;
+    if (proven) {
+        std::vector<int> pv = MatePv(2 * proven - 1);
+        std::string info = "info depth " + std::to_string(2 * proven - 1) + " seldepth " + std::to_string(search.seldepth) +
+                           " score mate " + std::to_string(proven) + " nodes " + std::to_string(search.nodes) +
+                           " time " + std::to_string(elapsed) + " pv";
+        for (int move : pv) info += " " + PrMove(move);
+        UciOut(info);
+        UciOut("bestmove " + PrMove(pv.empty() ? NO_MOVE : pv[0]));
+        search.thinking = false;
+    } else {
+        UciOut("info string " + std::string(disproven ? "no mate in " : "mate search stopped before mate in ") +
+               std::to_string(moves) + " nodes " + std::to_string(search.nodes) + " time " + std::to_string(elapsed));
+        int limitReached = (search.nodeLimit != 0 && search.nodes >= search.nodeLimit) || (movetime >= 0 && elapsed >= movetime);
+        long long remainingTime = (movetime >= 0) ? std::max(1LL, movetime - elapsed) : -1;
+        long long remainingNodes = (nodes > 0) ? std::max(1LL, nodes - search.nodes) : 0;
+        SetSearchLimits(std::min(2 * moves, MATE_FALLBACK_DEPTH), remainingTime, remainingNodes);
+        // Only a disproof within the budget searches on, with what is left of it. After a stop or a spent budget,
+        // SearchPosition returns at once with a legal bestmove.
+        if (!disproven || limitReached) search.stop = true;
+        SearchPosition();
+    }
+    mateTable.clear();
+    mateTable.shrink_to_fit();
+}
+
+void StartUciSearch(int depth, int nodes, long long movetime, const std::vector<int>& searchMoves) {
+    search.thinking = true;
+    SetSearchLimits(depth, movetime, nodes);
+    search.searchMoveNum = static_cast<int>(searchMoves.size());
+    std::copy(searchMoves.begin(), searchMoves.end(), search.searchMoves);
+
+    // The cache holds one line for the whole position, so searches restricted with searchmoves or asking for
+    // several MultiPV lines bypass it
+    std::shared_ptr<AnalysisCache> cache = (searchMoves.empty() && search.multiPv <= 1) ? analysisCache : nullptr;
+    uint64_t key = 0;
+    int cachedDepth = 0;
+    if (cache) {
+        key = GeneratePosKey64();
+        if (ProbeBeforeSearch(*cache, key, search.depth, cachedDepth)) {
+            std::string info = "info depth " + std::to_string(search.completedDepth) + " score " + UciScore(search.score) +
+                               " nodes 0 time 0 pv";
+            for (int i = 0; i < search.pvNum; i++) {
+                info += " " + PrMove(board.PvArray[i]);
+            }
+            UciOut(info);
+            UciOut("info string analysis cache hit");
+            UciOut("bestmove " + PrMove(search.best));
+            search.thinking = false;
+            return;
+        }
+    }
+
+    if (PROFILE_ENABLED) memset(&profile, 0, sizeof(profile));
+    SearchPosition();
+    PrintProfile();
+    
+    if (cache && search.completedDepth > cachedDepth) StoreSearchResult(*cache, key);
+}
+
+// A slice of the remaining clock plus most of the increment, never more than half of what is left
+long long AllocateMoveTime(long long remaining, long long increment, int movesToGo) {
+    long long budget = remaining / (movesToGo > 0 ? movesToGo : 30) + increment * 3 / 4;
+    return std::max(1LL, std::min(budget, remaining / 2));
+}
+
+void HandleGo(const std::string& command) {
+    std::istringstream iss(command);
+    std::string token;
+    iss >> token;
+
+    int depth = MAX_DEPTH, nodes = -1, mate = 0;
+    long long movetime = -1;
+    long long clock[2] = {-1, -1};
+    long long increment[2] = {0, 0};
+    int movesToGo = 0;
+    std::vector<int> searchMoves;
+    int readingMoves = false;
+    while (iss >> token) {
+        if (token == "searchmoves") {
+            readingMoves = true;
+            continue;
+        }
+        if (readingMoves) {
+            int move = ParseUciMove(token);
+            if (move != NO_MOVE) {
+                searchMoves.push_back(move);
+                continue;
+            }
+            readingMoves = false;
+        }
+        
+        if (token == "depth") iss >> depth;
+        if (token == "nodes") iss >> nodes;
+        if (token == "movetime") iss >> movetime;
+        if (token == "wtime") iss >> clock[WHITE];
+        if (token == "btime") iss >> clock[BLACK];
+        if (token == "winc") iss >> increment[WHITE];
+        if (token == "binc") iss >> increment[BLACK];
+        if (token == "movestogo") iss >> movesToGo;
+        if (token == "mate") iss >> mate;
+    }
+    if (movetime == -1 && clock[board.side] >= 0) {
+        movetime = AllocateMoveTime(clock[board.side], increment[board.side], movesToGo);
+    }
+    // Time spent queued on the server has already run off the client's clock
+    if (movetime >= 0 && search.queuedTime > 0) movetime = std::max(1LL, movetime - search.queuedTime);
+    if (search.moveTimeCap > 0) movetime = (movetime < 0) ? search.moveTimeCap : std::min(movetime, search.moveTimeCap);
+    if (mate > 0) {
+        StartMateSearch(mate, std::max(nodes, 0), movetime);
+        return;
+    }
+
+    StartUciSearch(depth, nodes, movetime, searchMoves);
+}
+
+void HandleStop() {
+    search.stop = true;
+}
+
+// Starts a new trace file, closing the previous one. An empty path only closes it.
+bool OpenTraceFile(const std::string& path) {
+    if (trace.file != nullptr) fclose(trace.file);
+    trace.file = nullptr;
+    if (path.empty() || path == "<empty>") return true;
+    
+    trace.file = fopen(path.c_str(), "wb");
+    if (trace.file == nullptr) return false;
+    fwrite(TRACE_MAGIC, sizeof(TRACE_MAGIC), 1, trace.file);
+    return true;
+}
+
+// Splits "setoption name <name> value <value>" into the lowercase name and the raw value
+bool ParseSetOption(const std::string& command, std::string& name, std::string& value) {
+    std::istringstream iss(command);
+    std::string token;
+    iss >> token >> token;
+    if (token != "name") return false;
+    
+    while (iss >> token && token != "value") {
+        name += (name.empty() ? "" : " ") + token;
+    }
+    std::getline(iss, value);
+    std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+    return true;
+}
+
+void HandleSetOption(const std::string& command) {
+    std::string name;
+    std::string value;
+    if (!ParseSetOption(command, name, value)) return;
+    
+    if (name == "multipv") {
+        search.multiPv = std::max(1, std::min(std::atoi(value.c_str()), MAX_MULTI_PV));
+    } else if (name == "analysiscache") {
+        value.erase(0, value.find_first_not_of(' '));
+        analysisCache = (value.empty() || value == "<empty>") ? nullptr : OpenAnalysisCache(value);
+        if (!value.empty() && value != "<empty>" && !analysisCache) UciOut("info string cannot open analysis cache " + value);
+    } else if (name == "evalfile") {
+        value.erase(0, value.find_first_not_of(' '));
+        EvalParams params = DefaultEvalParams;
+        if (value.empty() || value == "<empty>") {
+            loadedEvalParams = nullptr;
+        } else if (LoadEvalParams(value, params)) {
+            loadedEvalParams = std::make_shared<const EvalParams>(params);
+        } else {
+            UciOut("info string cannot load evaluation parameters " + value);
+        }
+    } else if (name == "tracefile" || name == "tracemaxply" || name == "tracenodes") {
+        value.erase(0, value.find_first_not_of(' '));
+        if (!TRACE_ENABLED) {
+            UciOut("info string search tracing is not compiled in, build with -DSLOWFISH_TRACE=1");
+        } else if (name == "tracemaxply") {
+            trace.maxPly = std::max(0, std::min(std::atoi(value.c_str()), MAX_DEPTH));
+        } else if (name == "tracenodes") {
+            trace.nodeBudget = std::max(0LL, std::atoll(value.c_str()));
+        } else if (!OpenTraceFile(value)) {
+            UciOut("info string cannot open trace file " + value);
+        }
+    } else if (name == "matehash") {
+        search.mateHashMb = std::max(1, std::min(std::atoi(value.c_str()), MAX_MATE_HASH_MB));
+    } else if (name == "hash") {
+        search.hashMb = std::max(1, std::min(std::atoi(value.c_str()), MAX_HASH_MB));
+        ClearPvTable();
+        UciOut("info string hash " + std::to_string(board.PvTableEntries * sizeof(Board::PvEntry) / 1024) + " KB" +
+               (board.PvTableLargePages ? " in huge pages" : ""));
+    }
+}
+
+// Runs every position of an EPD suite for movetime ms and records when the bm/am/dm condition first held for good
+void HandleTestSuite(const std::string& command) {
+    std::istringstream iss(command);
+    std::string token;
+    std::string path;
+    long long movetime = 1000;
+    iss >> token >> path;
+    if (iss >> token) movetime = std::atoll(token.c_str());
+    
+    MappedFile file;
+    if (path.empty() || !MapFile(path, file)) {
+        UciOut("info string cannot open test suite " + path);
+        return;
+    }
+    
+    int total = 0;
+    int solved = 0;
+    long long totalTime = 0;
+    long long totalNodes = 0;
+    std::string fen;
+    std::string operations;
+    
+    ForEachLineInChunk(file, 0, file.size, [&](const char* line, size_t length) {
+        if (length == 0 || line[0] == '#') return;
+        if (!SplitEpdLine(line, length, fen, operations)) return;
+        
+        ParseFen(fen);
+        if (board.pieceNum[WHITE_KING] != 1 || board.pieceNum[BLACK_KING] != 1) return;
+        
+        std::vector<int> bestMoves;
+        std::vector<int> avoidMoves;
+        std::istringstream bm(EpdOperand(operations, "bm"));
+        while (bm >> token) {
+            int move = ParseSan(token);
+            if (move != NO_MOVE) bestMoves.push_back(move);
+        }
+        std::istringstream am(EpdOperand(operations, "am"));
+        while (am >> token) {
+            int move = ParseSan(token);
+            if (move != NO_MOVE) avoidMoves.push_back(move);
+        }
+        int mateDistance = std::atoi(EpdOperand(operations, "dm").c_str());
+        
+        if (bestMoves.empty() && avoidMoves.empty() && mateDistance <= 0) {
+            UciOut("info string skipping position without usable bm/am/dm " + fen);
+            return;
+        }
+        
+        total++;
+        int solvedDepth = -1;
+        long long solvedNodes = 0;
+        long long solvedTime = 0;
+        
+        iterationCallback = [&]() {
+            int correct = true;
+            if (!bestMoves.empty() && std::find(bestMoves.begin(), bestMoves.end(), search.best) == bestMoves.end()) {
+                correct = false;
+            }
+            if (std::find(avoidMoves.begin(), avoidMoves.end(), search.best) != avoidMoves.end()) {
+                correct = false;
+            }
+            if (mateDistance > 0 && (search.score <= MATE - MAX_DEPTH || (MATE - search.score + 1) / 2 > mateDistance)) {
+                correct = false;
+            }
+            
+            if (!correct) {
+                solvedDepth = -1;
+            } else if (solvedDepth < 0) {
+                solvedDepth = search.completedDepth;
+                solvedNodes = search.nodes;
+                solvedTime = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    std::chrono::steady_clock::now().time_since_epoch()).count() - search.start;
+            }
+        };
+        
+        search.quiet = true;
+        search.stop = false;
+        SetSearchLimits(MAX_DEPTH, movetime, 0);
+        ClearHistoryTables();
+        ClearPvTable();
+        SearchPosition();
+        search.quiet = false;
+        iterationCallback = nullptr;
+        
+        std::string id = EpdOperand(operations, "id");
+        std::string info = "info string testsuite " + std::to_string(total) + (id.empty() ? "" : " id " + id);
+        if (solvedDepth >= 0) {
+            solved++;
+            totalTime += solvedTime;
+            totalNodes += solvedNodes;
+            info += " solved depth " + std::to_string(solvedDepth) + " nodes " + std::to_string(solvedNodes) + " time " + std::to_string(solvedTime);
+        } else {
+            totalTime += movetime;
+            totalNodes += search.nodes;
+            info += " failed";
+        }
+        UciOut(info + " bestmove " + PrMove(search.best));
+    });
+    UnmapFile(file);
+    
+    UciOut("info string testsuite solved " + std::to_string(solved) + "/" + std::to_string(total) +
+           " time-to-solution " + std::to_string(totalTime) + " nodes-to-solution " + std::to_string(totalNodes));
+}
+
+void ParseUciCommand(const std::string& command) {
+    std::istringstream iss(command);
+    std::string token;
+    iss >> token;
+    
+    if (token == "uci") {
+        HandleUci();
+    } else if (token == "isready") {
+        HandleIsReady();
+    } else if (token == "ucinewgame") {
+        HandleUciNewGame();
+    } else if (token == "position") {
+        HandlePosition(command);
+    } else if (token == "go") {
+        HandleGo(command);
+    } else if (token == "stop") {
+        HandleStop();
+    } else if (token == "setoption") {
+        HandleSetOption(command);
+    } else if (token == "bench") {
+        HandleBench(command);
+    } else if (token == "perft") {
+        HandlePerft(command);
+    } else if (token == "stats") {
+        UciOut(StatsJson());
+    } else if (token == "testsuite") {
+        HandleTestSuite(command);
+    } else if (token == "quit") {
+        exit(0);
+    }
+}
+
+struct Engine::Worker {
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable finished;
+    std::deque<std::pair<long long, std::function<void()>>> jobs;
+    long long queuedJobs = 0;
+    long long finishedJobs = 0;
+    long long stopBefore = 0;
+    long long searchJob = 0;    // The last queued go
+    int quit = false;
+    Search* searchState = nullptr;
+    std::vector<std::pair<uint64_t, int>> hashInbox;
+    
+    void Run() {
+        std::unique_lock<std::mutex> lock(mutex);
+        searchState = &::search;
+        // The hash carries over from one go to the next and is only cleared by ucinewgame or a new Hash size
+        ::search.keepHash = true;
+        pollCallback = [this]() { DrainHashInbox(); };
+        BindSearchThread();
+        finished.notify_all();
+        
+        for (;;) {
+            wake.wait(lock, [this]() { return quit || !jobs.empty(); });
+            if (jobs.empty()) break;
+            
+            std::pair<long long, std::function<void()>> job = std::move(jobs.front());
+            jobs.pop_front();
+            ::search.stop = (job.first <= stopBefore);
+            lock.unlock();
+            
+            job.second();
+            
+            lock.lock();
+            finishedJobs = job.first;
+            finished.notify_all();
+        }
+        FreeSearchTables();
+    }
+    
+    long long Post(std::function<void()> task) {
+        std::lock_guard<std::mutex> lock(mutex);
+        jobs.emplace_back(++queuedJobs, std::move(task));
+        wake.notify_one();
+        return queuedJobs;
+    }
+    
+    void Wait(long long job) {
+        std::unique_lock<std::mutex> lock(mutex);
+        finished.wait(lock, [this, job]() { return finishedJobs >= job; });
+    }
+    
+    int Searching() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return finishedJobs < searchJob;
+    }
+    
+    // Hash entries sent by other cluster workers, applied on the engine thread while it searches
+    void DrainHashInbox() {
+        std::vector<std::pair<uint64_t, int>> entries;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (hashInbox.empty()) return;
+            entries.swap(hashInbox);
+        }
+        for (const std::pair<uint64_t, int>& entry : entries) {
+            StorePvEntry(entry.first, entry.second);
+        }
+    }
+};
+
+SearchInfo CurrentSearchInfo(int lineIndex = 0) {
+    const PvLine& line = search.lines[lineIndex];
+    SearchInfo info;
+    info.depth = line.depth;
+    info.seldepth = search.seldepth;
+    info.multipv = lineIndex + 1;
+    info.score = line.score;
+    if (std::abs(line.score) > MATE - MAX_DEPTH) {
+        info.mate = (MATE - std::abs(line.score) + 1) / 2;
+        if (line.score < 0) info.mate = -info.mate;
+    }
+    info.nodes = search.nodes;
+    info.time = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count() - search.start;
+    info.hashfull = HashFull();
+    for (int i = 0; i < line.length; i++) {
+        info.pv.push_back(PrMove(line.moves[i]));
+    }
+    return info;
+}
+
+Engine::Engine() : worker(new Worker()) {
+    std::call_once(initFlag, init);
+    worker->thread = std::thread(&Worker::Run, worker);
+    std::unique_lock<std::mutex> lock(worker->mutex);
+    worker->finished.wait(lock, [this]() { return worker->searchState != nullptr; });
+}
+
+Engine::~Engine() {
+    stop();
+    {
+        std::lock_guard<std::mutex> lock(worker->mutex);
+        worker->quit = true;
+        worker->wake.notify_one();
+    }
+    worker->thread.join();
+    delete worker;
+}
+
+SearchResult Engine::search(const std::string& fen, const SearchLimits& limits,
+                            const std::function<void(const SearchInfo&)>& callback) {
+    SearchResult result;
+    long long job = worker->Post([&]() {
+        ParseFen(fen);
+        int multiPv = ::search.multiPv;
+        ::search.multiPv = limits.multiPv;
+        ::search.quiet = true;
+        iterationCallback = [&]() {
+            if (!callback) return;
+            for (int index = 0; index < MAX_MULTI_PV && ::search.lines[index].depth == ::search.completedDepth; ++index) {
+                callback(CurrentSearchInfo(index));
+            }
+        };
+        SetSearchLimits(limits.depth > 0 ? limits.depth : MAX_DEPTH, limits.movetime, limits.nodes);
+        for (const std::string& moveStr : limits.searchMoves) {
+            int move = ParseUciMove(moveStr);
+            if (move != NO_MOVE) ::search.searchMoves[::search.searchMoveNum++] = move;
+        }
+        SearchPosition();
+        
+        result.bestMove = PrMove(::search.best);
+        result.info = CurrentSearchInfo();
+        for (int index = 0; index < MAX_MULTI_PV && ::search.lines[index].depth > 0; ++index) {
+            result.lines.push_back(CurrentSearchInfo(index));
+        }
+        iterationCallback = nullptr;
+        ::search.quiet = false;
+        ::search.multiPv = multiPv;
+    });
+    worker->Wait(job);
+    return result;
+}
+
+std::string Engine::gameState(const std::string& fen) {
+    std::string state;
+    worker->Wait(worker->Post([&]() {
+        state = getGameState(fen);
+    }));
+    return state;
+}
+
+std::vector<std::string> Engine::legalMoves(const std::string& fen) {
+    std::vector<std::string> result;
+    worker->Wait(worker->Post([&]() {
+        ParseFen(fen);
+        std::vector<int> moves;
+        GenerateLegalMoves(moves);
+        for (int move : moves) {
+            result.push_back(PrMove(move));
+        }
+    }));
+    return result;
+}
+
+void Engine::uci(const std::string& command, const std::function<void(const std::string&)>& output) {
+    std::istringstream iss(command);
+    std::string token;
+    iss >> token;
+    
+    if (token == "stop" || token == "quit") {
+        stop();
+    } else if (token == "isready" && worker->Searching()) {
+        // While a search runs isready is answered at once, otherwise it waits behind the queued commands
+        output("readyok");
+    } else if (token == "hashstore") {
+        uint64_t posKey = 0;
+        int move = NO_MOVE;
+        if (iss >> posKey >> move) {
+            std::lock_guard<std::mutex> lock(worker->mutex);
+            worker->hashInbox.emplace_back(posKey, move);
+        }
+    } else if (!token.empty()) {
+        long long job = worker->Post([command, output]() {
+            outputCallback = output;
+            ParseUciCommand(command);
+            outputCallback = nullptr;
+        });
+        if (token == "go") {
+            std::lock_guard<std::mutex> lock(worker->mutex);
+            worker->searchJob = job;
+        }
+    }
+}
+
+void Engine::stop() {
+    std::lock_guard<std::mutex> lock(worker->mutex);
+    worker->stopBefore = worker->queuedJobs;
+    worker->searchState->stop = true;
+}
+
+// The command line front end is a thin wrapper that forwards each line to an Engine, so "stop" works mid-search
+void UciLoop() {
+    Engine engine;
+    std::string command;
+    std::function<void(const std::string&)> output = WriteLine;
+    
+    while (std::getline(std::cin, command)) {
+        engine.uci(command, output);
+        if (command.compare(0, 4, "quit") == 0) return;
+    }
+    // End of input is a quit
+    engine.uci("quit", output);
+}
+
+// Worker threads claim fixed-size chunks of the file, and each chunk's output is written back in input order
+template <typename LineHandler>
+void ProcessFileInParallel(const MappedFile& file, int jobs, std::ostream& out, LineHandler handler) {
+    const size_t CHUNK_SIZE = 16384;
+    size_t chunkCount = (file.size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    std::atomic<size_t> nextChunk(0);
+    std::mutex outputMutex;
+    std::map<size_t, std::string> pending;
+    size_t nextToWrite = 0;
+    
+    auto worker = [&]() {
+        BindSearchThread();
+        for (size_t chunk = nextChunk++; chunk < chunkCount; chunk = nextChunk++) {
+            std::string results;
+            size_t end = std::min((chunk + 1) * CHUNK_SIZE, file.size);
+            
+            ForEachLineInChunk(file, chunk * CHUNK_SIZE, end, [&](const char* line, size_t length) {
+                handler(line, length, results);
+            });
+            
+            std::lock_guard<std::mutex> lock(outputMutex);
+            pending[chunk] = std::move(results);
+            while (!pending.empty() && pending.begin()->first == nextToWrite) {
+                out << pending.begin()->second;
+                pending.erase(pending.begin());
+                nextToWrite++;
+            }
+        }
+        FreeSearchTables();
+    };
+    
+    std::vector<std::thread> workers;
+    for (int i = 0; i < jobs; ++i) {
+        workers.emplace_back(worker);
+    }
+    for (std::thread& t : workers) {
+        t.join();
+    }
+}
+
+struct AnalyzeOptions {
+    std::string input;
+    std::string output;
+    std::string format;
+    int depth;
+    long long movetime;
+    int jobs;
+    std::string cache;
+};
+
+std::string FormatAnalysis(const std::string& fen, const std::string& id, long long elapsed, const AnalyzeOptions& options) {
+    std::string scoreType = "cp";
+    int scoreValue = search.score;
+    if (std::abs(search.score) > MATE - MAX_DEPTH) {
+        scoreType = "mate";
+        scoreValue = (MATE - std::abs(search.score) + 1) / 2;
+        if (search.score < 0) scoreValue = -scoreValue;
+    }
+    
+    std::string line;
+    if (options.format == "csv") {
+        std::string quotedId;
+        for (char c : id) {
+            quotedId += c;
+            if (c == '"') quotedId += '"';
+        }
+        line = fen + ",\"" + quotedId + "\"," + std::to_string(search.completedDepth) + "," + scoreType + "," + std::to_string(scoreValue);
+        line += "," + PrMove(search.best) + ",";
+        for (int i = 0; i < search.pvNum; ++i) {
+            if (i > 0) line += ' ';
+            line += PrMove(board.PvArray[i]);
+        }
+        line += "," + std::to_string(search.nodes) + "," + std::to_string(elapsed) + "\n";
+    } else {
+        line = "{\"fen\":\"" + fen + "\"";
+        if (!id.empty()) line += ",\"id\":\"" + JsonEscape(id) + "\"";
+        line += ",\"depth\":" + std::to_string(search.completedDepth);
+        line += ",\"score\":{\"" + scoreType + "\":" + std::to_string(scoreValue) + "}";
+        line += ",\"bestmove\":\"" + PrMove(search.best) + "\",\"pv\":[";
+        for (int i = 0; i < search.pvNum; ++i) {
+            if (i > 0) line += ',';
+            line += "\"" + PrMove(board.PvArray[i]) + "\"";
+        }
+        line += "],\"nodes\":" + std::to_string(search.nodes) + ",\"time\":" + std::to_string(elapsed) + "}\n";
+    }
+    return line;
+}
+
+int RunAnalyze(int argc, char* argv[]) {
+    AnalyzeOptions options = {"", "", "", 8, -1, static_cast<int>(std::thread::hardware_concurrency()), ""};
+    
+    for (int i = 2; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) break;
+        if (arg == "--input") options.input = argv[++i];
+        else if (arg == "--output") options.output = argv[++i];
+        else if (arg == "--format") options.format = argv[++i];
+        else if (arg == "--depth") options.depth = std::atoi(argv[++i]);
+        else if (arg == "--movetime") options.movetime = std::atoll(argv[++i]);
+        else if (arg == "--jobs") options.jobs = std::atoi(argv[++i]);
+        else if (arg == "--cache") options.cache = argv[++i];
+    }
+    
+    if (options.input.empty()) {
+        std::cerr << "Usage: slowfish analyze --input <file.epd> [--depth N] [--movetime ms] [--jobs K] [--output file] [--format jsonl|csv] [--cache file]" << std::endl;
+        return 1;
+    }
+    
+    std::shared_ptr<AnalysisCache> cache;
+    if (!options.cache.empty()) {
+        cache = OpenAnalysisCache(options.cache);
+        if (!cache) {
+            std::cerr << "Error: Cannot open analysis cache: " << options.cache << std::endl;
+            return 1;
+        }
+    }
+    
+    options.depth = std::max(1, std::min(options.depth, MAX_DEPTH));
+    options.jobs = std::max(1, options.jobs);
+    if (options.format.empty()) {
+        bool csvName = options.output.length() >= 4 && options.output.substr(options.output.length() - 4) == ".csv";
+        options.format = csvName ? "csv" : "jsonl";
+    }
+    
+    MappedFile file;
+    if (!MapFile(options.input, file)) {
+        std::cerr << "Error: Cannot open input file: " << options.input << std::endl;
+        return 1;
+    }
+    
+    std::ofstream outFile;
+    std::ostream* out = &std::cout;
+    if (!options.output.empty()) {
+        outFile.open(options.output, std::ios::binary);
+        if (!outFile) {
+            std::cerr << "Error: Cannot open output file: " << options.output << std::endl;
+            UnmapFile(file);
+            return 1;
+        }
+        out = &outFile;
+    }
+    
+    if (options.format == "csv") {
+        *out << "fen,id,depth,score_type,score,bestmove,pv,nodes,time\n";
+    }
+    
+    std::atomic<long long> positions(0);
+    std::atomic<long long> totalNodes(0);
+    long long start = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+    
+    ProcessFileInParallel(file, options.jobs, *out, [&](const char* line, size_t length, std::string& results) {
+        std::string fen;
+        std::string operations;
+        if (length == 0 || line[0] == '#') return;
+        if (!SplitEpdLine(line, length, fen, operations)) return;
+        
+        ParseFen(fen);
+        if (board.pieceNum[WHITE_KING] != 1 || board.pieceNum[BLACK_KING] != 1) return;
+        
+        search.quiet = true;
+        search.stop = false;
+        SetSearchLimits(options.depth, options.movetime, 0);
+        
+        uint64_t key = 0;
+        int cachedDepth = 0;
+        int cached = false;
+        if (cache) {
+            key = GeneratePosKey64();
+            cached = ProbeBeforeSearch(*cache, key, options.depth, cachedDepth);
+        }
+        if (!cached) {
+            ClearHistoryTables();
+            SearchPosition();
+            if (cache && search.completedDepth > cachedDepth) StoreSearchResult(*cache, key);
+        }
+        
+        long long elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count() - search.start;
+        results += FormatAnalysis(fen, EpdOperand(operations, "id"), elapsed, options);
+        positions++;
+        totalNodes += search.nodes;
+    });
+    out->flush();
+    UnmapFile(file);
+    
+    long long elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count() - start;
+    std::cerr << "info string analyzed " << positions << " positions nodes " << totalNodes
+              << " time " << elapsed << " jobs " << options.jobs << std::endl;
+    return 0;
+}
+
+// Labels a FEN or EPD line the same way as getGameState, or "invalid" if it cannot be parsed
+std::string ClassifyLine(const char* line, size_t length) {
+    std::string fen;
+    std::string operations;
+    if (!SplitEpdLine(line, length, fen, operations)) return "invalid";
+    
+    ParseFen(fen);
+    if (board.pieceNum[WHITE_KING] != 1 || board.pieceNum[BLACK_KING] != 1) return "invalid";
+    return BoardGameState();
+}
+
+std::vector<std::string> classifyGameStates(const std::vector<std::string>& fens, int threads) {
+    std::call_once(initFlag, init);
+    if (threads <= 0) threads = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+    
+    const size_t BLOCK_SIZE = 1024;
+    std::vector<std::string> states(fens.size());
+    std::atomic<size_t> nextBlock(0);
+    
+    auto worker = [&]() {
+        for (size_t first = nextBlock++ * BLOCK_SIZE; first < fens.size(); first = nextBlock++ * BLOCK_SIZE) {
+            size_t last = std::min(first + BLOCK_SIZE, fens.size());
+            for (size_t index = first; index < last; ++index) {
+                states[index] = ClassifyLine(fens[index].data(), fens[index].length());
+            }
+        }
+    };
+    
+    std::vector<std::thread> workers;
+    for (int i = 0; i < threads; ++i) {
+        workers.emplace_back(worker);
+    }
+    for (std::thread& t : workers) {
+        t.join();
+    }
+    return states;
+}
+
+int RunClassify(int argc, char* argv[]) {
+    std::string input;
+    std::string output;
+    int jobs = static_cast<int>(std::thread::hardware_concurrency());
+    
+    for (int i = 2; i + 1 < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--input") input = argv[++i];
+        else if (arg == "--output") output = argv[++i];
+        else if (arg == "--jobs") jobs = std::atoi(argv[++i]);
+    }
+    
+    if (input.empty()) {
+        std::cerr << "Usage: slowfish classify --input <file> [--jobs K] [--output file]" << std::endl;
+        return 1;
+    }
+    
+    MappedFile file;
+    if (!MapFile(input, file)) {
+        std::cerr << "Error: Cannot open input file: " << input << std::endl;
+        return 1;
+    }
+    
+    std::ofstream outFile;
+    std::ostream* out = &std::cout;
+    if (!output.empty()) {
+        outFile.open(output, std::ios::binary);
+        if (!outFile) {
+            std::cerr << "Error: Cannot open output file: " << output << std::endl;
+            UnmapFile(file);
+            return 1;
+        }
+        out = &outFile;
+    }
+    
+    std::atomic<long long> positions(0);
+    long long start = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+    
+    ProcessFileInParallel(file, std::max(1, jobs), *out, [&](const char* line, size_t length, std::string& results) {
+        results += ClassifyLine(line, length);
+        results += '\n';
+        positions++;
+    });
+    out->flush();
+    UnmapFile(file);
+    
+    long long elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count() - start;
+    std::cerr << "info string classified " << positions << " positions time " << elapsed << std::endl;
+    return 0;
+}
+
+// Quiescence search that also returns its principal variation, used to resolve tuning positions to quiet leaves
+int QuiescencePv(int alpha, int beta, int* pv, int& pvLength) {
+    pvLength = 0;
+    int score = EvalPosition();
+    if (board.ply > MAX_DEPTH - 2) return score;
+    if (score >= beta) return beta;
+    if (score > alpha) alpha = score;
+    
+    GenerateCaptures();
+    int childPv[MAX_DEPTH];
+    int childLength = 0;
+    for (int moveNum = board.moveListStart[board.ply]; moveNum < board.moveListStart[board.ply + 1]; ++moveNum) {
+        PickNextMove(moveNum);
+        int move = board.moveList[moveNum].move;
+        if (MakeMove(move) == false) continue;
+        score = -QuiescencePv(-beta, -alpha, childPv, childLength);
+        TakeMove();
+        
+        if (score > alpha) {
+            if (score >= beta) return beta;
+            alpha = score;
+            pv[0] = move;
+            std::copy(childPv, childPv + childLength, pv + 1);
+            pvLength = childLength + 1;
+        }
+    }
+    return alpha;
+}
+
+// The game result from white's point of view, from a c9 opcode or a "1-0", "0-1", "1/2-1/2", [1.0], [0.5] or [0.0] token
+// Only the c9 operand or a standalone result token at the end of the line is read, so results quoted in other
+// operations such as id or a comment are never taken as the label
+double TuneResultLabel(const std::string& operations) {
+    std::string text = EpdOperand(operations, "c9");
+    if (text.empty()) {
+        size_t end = operations.find_last_not_of(" \t\r;");
+        if (end == std::string::npos) return -1.0;
+        size_t start = operations.find_last_of(" \t;", end);
+        start = (start == std::string::npos) ? 0 : start + 1;
+        text = operations.substr(start, end + 1 - start);
+    }
+    if (text == "1/2-1/2" || text == "[0.5]") return 0.5;
+    if (text == "1-0" || text == "[1.0]") return 1.0;
+    if (text == "0-1" || text == "[0.0]") return 0.0;
+    return -1.0;
+}
+
+struct TuneFeature {
+    int16_t index;
+    int16_t coefficient;
+};
+
+// One thread's share of the dataset. Each position keeps only the parameters its quiet leaf uses.
+struct TuneShard {
+    std::vector<TuneFeature> features;
+    std::vector<uint32_t> featureEnd;
+    std::vector<float> results;
+    long long skipped = 0;
+};
+
+void LoadTuneShard(const MappedFile& file, size_t begin, size_t end, TuneShard& shard) {
+    SetSearchLimits(MAX_DEPTH, -1, 0);
+    search.stop = false;
+    
+    ForEachLineInChunk(file, begin, end, [&](const char* line, size_t length) {
+        std::string fen;
+        std::string operations;
+        double result = -1.0;
+        if (SplitEpdLine(line, length, fen, operations)) result = TuneResultLabel(operations);
+        if (result < 0) {
+            if (length > 0) shard.skipped++;
+            return;
+        }
+        ParseFen(fen);
+        if (board.pieceNum[WHITE_KING] != 1 || board.pieceNum[BLACK_KING] != 1 ||
+            SqAttacked(board.pList[PCEINDEX(KINGS[board.side ^ 1], 0)], board.side)) {
+            shard.skipped++;
+            return;
+        }
+        
+        int pv[MAX_DEPTH];
+        int pvLength = 0;
+        QuiescencePv(-INFINITE, INFINITE, pv, pvLength);
+        for (int i = 0; i < pvLength; ++i) {
+            MakeMove(pv[i]);
+        }
+        
+        EvalTrace trace;
+        memset(&trace, 0, sizeof(trace));
+        EvaluatePosition(trace);
+        for (int index = 0; index < EVAL_PARAM_COUNT; ++index) {
+            if (trace.coefficients[index] != 0) {
+                shard.features.push_back({static_cast<int16_t>(index), static_cast<int16_t>(trace.coefficients[index])});
+            }
+        }
+        shard.featureEnd.push_back(static_cast<uint32_t>(shard.features.size()));
+        shard.results.push_back(static_cast<float>(result));
+    });
+}
+
+inline double TuneSigmoid(double eval, double k) {
+    return 1.0 / (1.0 + std::exp(-k * eval * std::log(10.0) / 400.0));
+}
+
+// Mean squared error of the shard's predictions. With a gradient array, also adds the error's partial derivatives.
+double TuneShardError(const TuneShard& shard, const double* params, double k, double* gradient) {
+    double error = 0;
+    uint32_t begin = 0;
+    for (size_t position = 0; position < shard.results.size(); ++position) {
+        uint32_t end = shard.featureEnd[position];
+        double eval = 0;
+        for (uint32_t i = begin; i < end; ++i) {
+            eval += shard.features[i].coefficient * params[shard.features[i].index];
+        }
+        double predicted = TuneSigmoid(eval, k);
+        double difference = shard.results[position] - predicted;
+        error += difference * difference;
+        
+        if (gradient != nullptr) {
+            double slope = -2.0 * difference * predicted * (1.0 - predicted) * std::log(10.0) * k / 400.0;
+            for (uint32_t i = begin; i < end; ++i) {
+                gradient[shard.features[i].index] += slope * shard.features[i].coefficient;
+            }
+        }
+        begin = end;
+    }
+    return error;
+}
+
+// Runs TuneShardError on every shard in parallel and returns the mean error over all positions
+double TuneError(const std::vector<TuneShard>& shards, const std::vector<double>& params, double k, std::vector<double>* gradient) {
+    std::vector<double> errors(shards.size());
+    std::vector<std::vector<double>> gradients(shards.size());
+    std::vector<std::thread> threads;
+    for (size_t index = 0; index < shards.size(); ++index) {
+        threads.emplace_back([&, index]() {
+            if (gradient != nullptr) gradients[index].assign(EVAL_PARAM_COUNT, 0.0);
+            errors[index] = TuneShardError(shards[index], params.data(), k, gradient != nullptr ? gradients[index].data() : nullptr);
+        });
+    }
+    
+    double error = 0;
+    size_t positions = 0;
+    if (gradient != nullptr) gradient->assign(EVAL_PARAM_COUNT, 0.0);
+    for (size_t index = 0; index < shards.size(); ++index) {
+        threads[index].join();
+        error += errors[index];
+        positions += shards[index].results.size();
+        if (gradient != nullptr) {
+            for (int i = 0; i < EVAL_PARAM_COUNT; ++i) (*gradient)[i] += gradients[index][i];
+        }
+    }
+    if (gradient != nullptr) {
+        for (double& value : *gradient) value /= std::max<size_t>(positions, 1);
+    }
+    return error / std::max<size_t>(positions, 1);
+}
+
+// Texel tuning: fits every evaluation parameter to the game results of a labelled EPD file. Positions are resolved
+// to quiet leaves with a quiescence search once, and their parameter coefficients are cached, so each epoch is a
+// multi-threaded pass over the cached features followed by an Adam step.
+int RunTune(int argc, char* argv[]) {
+    std::string input;
+    std::string output = "params.txt";
+    std::string start;
+    int epochs = 400;
+    double rate = 1.0;
+    int jobs = static_cast<int>(std::thread::hardware_concurrency());
+    
+    for (int i = 2; i + 1 < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--input") input = argv[++i];
+        else if (arg == "--output") output = argv[++i];
+        else if (arg == "--params") start = argv[++i];
+        else if (arg == "--epochs") epochs = std::atoi(argv[++i]);
+        else if (arg == "--rate") rate = std::atof(argv[++i]);
+        else if (arg == "--jobs") jobs = std::atoi(argv[++i]);
+    }
+    
+    if (input.empty()) {
+        std::cerr << "Usage: slowfish tune --input <file.epd> [--output params.txt] [--params start.txt] [--epochs N] [--rate R] [--jobs K]" << std::endl;
+        return 1;
+    }
+    if (!start.empty()) {
+        EvalParams params = DefaultEvalParams;
+        if (!LoadEvalParams(start, params)) {
+            std::cerr << "Error: Cannot load parameters: " << start << std::endl;
+            return 1;
+        }
+        loadedEvalParams = std::make_shared<const EvalParams>(params);
+    }
+    
+    MappedFile file;
+    if (!MapFile(input, file)) {
+        std::cerr << "Error: Cannot open input file: " << input << std::endl;
+        return 1;
+    }
+    
+    long long begin = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+    jobs = std::max(1, jobs);
+    std::vector<TuneShard> shards(jobs);
+    std::shared_ptr<const EvalParams> startParams = loadedEvalParams;
+    std::vector<std::thread> loaders;
+    for (int index = 0; index < jobs; ++index) {
+        loaders.emplace_back([&, index]() {
+            loadedEvalParams = startParams;
+            LoadTuneShard(file, file.size * index / jobs, file.size * (index + 1) / jobs, shards[index]);
+            FreeSearchTables();
+        });
+    }
+    size_t positions = 0;
+    long long skipped = 0;
+    for (int index = 0; index < jobs; ++index) {
+        loaders[index].join();
+        positions += shards[index].results.size();
+        skipped += shards[index].skipped;
+    }
+    UnmapFile(file);
+    if (positions == 0) {
+        std::cerr << "Error: No labelled positions in " << input << std::endl;
+        return 1;
+    }
+    long long elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count() - begin;
+    std::cerr << "info string tune positions " << positions << " skipped " << skipped << " time " << elapsed << std::endl;
+    
+    std::vector<double> params(EvalParamData(ActiveEvalParams()), EvalParamData(ActiveEvalParams()) + EVAL_PARAM_COUNT);
+    
+    // The scaling constant is fitted once to the starting parameters, by golden-section search
+    double low = 0.1;
+    double high = 4.0;
+    const double golden = (std::sqrt(5.0) - 1) / 2;
+    for (int step = 0; step < 30; ++step) {
+        double left = high - golden * (high - low);
+        double right = low + golden * (high - low);
+        if (TuneError(shards, params, left, nullptr) < TuneError(shards, params, right, nullptr)) high = right;
+        else low = left;
+    }
+    double k = (low + high) / 2;
+    std::cerr << "info string tune k " << k << " error " << TuneError(shards, params, k, nullptr) << std::endl;
+    
+    std::vector<double> gradient;
+    std::vector<double> momentum(EVAL_PARAM_COUNT, 0.0);
+    std::vector<double> velocity(EVAL_PARAM_COUNT, 0.0);
+    const double beta1 = 0.9;
+    const double beta2 = 0.999;
+    for (int epoch = 1; epoch <= epochs; ++epoch) {
+        double error = TuneError(shards, params, k, &gradient);
+        for (int i = 0; i < EVAL_PARAM_COUNT; ++i) {
+            momentum[i] = beta1 * momentum[i] + (1 - beta1) * gradient[i];
+            velocity[i] = beta2 * velocity[i] + (1 - beta2) * gradient[i] * gradient[i];
+            double corrected = momentum[i] / (1 - std::pow(beta1, epoch));
+            double scale = std::sqrt(velocity[i] / (1 - std::pow(beta2, epoch))) + 1e-12;
+            params[i] -= rate * corrected / scale;
+        }
+        if (epoch % 50 == 0 || epoch == epochs) {
+            elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count() - begin;
+            std::cerr << "info string tune epoch " << epoch << " error " << error << " time " << elapsed << std::endl;
+        }
+    }
+    
+    EvalParams tuned = ActiveEvalParams();
+    for (int i = 0; i < EVAL_PARAM_COUNT; ++i) {
+        EvalParamData(tuned)[i] = static_cast<int>(std::lround(params[i]));
+    }
+    if (!SaveEvalParams(output, tuned)) {
+        std::cerr << "Error: Cannot write parameters: " << output << std::endl;
+        return 1;
+    }
+    std::cerr << "info string tune wrote " << output << std::endl;
+    return 0;
+}
+
+// A position with its search score and game result in 32 bytes, stored little-endian. The occupied squares'
+// piece codes are packed two per byte, in square order from a1.
+struct PackedPosition {
+    uint64_t occupancy;     // Bit n is set when square n (a1 = 0, h8 = 63) holds a piece
+    uint8_t pieces[16];
+    int16_t score;          // Search score from the side to move's point of view
+    uint8_t result;         // 0 when black won, 1 for a draw, 2 when white won
+    uint8_t flags;          // Side to move in bit 0, castling rights in bits 1-4
+    uint8_t enPassant;      // En passant square (a1 = 0), 64 for none
+    uint8_t fiftyMove;
+    uint16_t fullMove;
+};
+static_assert(sizeof(PackedPosition) == 32, "PackedPosition must stay 32 bytes");
+
+PackedPosition PackPosition(int score, int result) {
+    PackedPosition packed;
+    memset(&packed, 0, sizeof(packed));
+    int count = 0;
+    for (int sq64 = 0; sq64 < 64; ++sq64) {
+        int piece = board.pieces[SQ120(sq64)];
+        if (piece == EMPTY) continue;
+        packed.occupancy |= 1ULL << sq64;
+        packed.pieces[count / 2] |= piece << (4 * (count % 2));
+        count++;
+    }
+    packed.score = static_cast<int16_t>(score);
+    packed.result = static_cast<uint8_t>(result);
+    packed.flags = static_cast<uint8_t>(board.side | (board.castlePerm << 1));
+    packed.enPassant = static_cast<uint8_t>(board.enPas == NO_SQ ? 64 : SQ64(board.enPas));
+    packed.fiftyMove = static_cast<uint8_t>(std::min(board.fiftyMove, 255));
+    packed.fullMove = static_cast<uint16_t>(std::min(board.fullMoveCount, 65535));
+    return packed;
+}
+
+// Sets up the board from a packed position
+void UnpackPosition(const PackedPosition& packed) {
+    int pieces[64];
+    int count = 0;
+    for (int sq64 = 0; sq64 < 64; ++sq64) {
+        pieces[sq64] = EMPTY;
+        if ((packed.occupancy >> sq64 & 1) == 0) continue;
+        pieces[sq64] = (packed.pieces[count / 2] >> (4 * (count % 2))) & 15;
+        count++;
+    }
+    
+    std::string fen;
+    for (int rank = RANK_8; rank >= RANK_1; --rank) {
+        int empty = 0;
+        for (int file = FILE_A; file <= FILE_H; ++file) {
+            int piece = pieces[rank * 8 + file];
+            if (piece == EMPTY || piece > BLACK_KING) {
+                empty++;
+                continue;
+            }
+            if (empty > 0) fen += static_cast<char>('0' + empty);
+            empty = 0;
+            fen += PieceChar[piece];
+        }
+        if (empty > 0) fen += static_cast<char>('0' + empty);
+        if (rank > RANK_1) fen += '/';
+    }
+    fen += (packed.flags & 1) ? " b " : " w ";
+    int castlePerm = packed.flags >> 1;
+    if (castlePerm & WKCA) fen += 'K';
+    if (castlePerm & WQCA) fen += 'Q';
+    if (castlePerm & BKCA) fen += 'k';
+    if (castlePerm & BQCA) fen += 'q';
+    if (castlePerm == 0) fen += '-';
+    fen += ' ';
+    if (packed.enPassant >= 64) {
+        fen += '-';
+    } else {
+        fen += static_cast<char>('a' + packed.enPassant % 8);
+        fen += static_cast<char>('1' + packed.enPassant / 8);
+    }
+    ParseFen(fen + " " + std::to_string(packed.fiftyMove) + " " + std::to_string(packed.fullMove));
+    board.fiftyMove = packed.fiftyMove;
+}
+
+// Appends whole games to a packed file from several threads
+struct PackedWriter {
+    std::ofstream out;
+    std::mutex mutex;
+    long long games = 0;
+    long long positions = 0;
+};
+
+void WritePackedGame(PackedWriter& writer, const std::vector<PackedPosition>& positions) {
+    std::lock_guard<std::mutex> lock(writer.mutex);
+    writer.out.write(reinterpret_cast<const char*>(positions.data()), positions.size() * sizeof(PackedPosition));
+    writer.games++;
+    writer.positions += positions.size();
+}
+
+// Streams a packed file in blocks, passing each position to the handler
+template <typename Handler>
+bool ForEachPackedPosition(const std::string& path, Handler handler) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) return false;
+    std::vector<PackedPosition> block(4096);
+    while (in) {
+        in.read(reinterpret_cast<char*>(block.data()), block.size() * sizeof(PackedPosition));
+        size_t count = static_cast<size_t>(in.gcount()) / sizeof(PackedPosition);
+        for (size_t index = 0; index < count; ++index) {
+            handler(block[index]);
+        }
+    }
+    return true;
+}
+
+struct DatagenOptions {
+    std::string output;
+    long long games;
+    long long nodes;
+    int jobs;
+    int randomPlies;
+    int maxPlies;
+    uint64_t seed;
+};
+
+// Plays one fixed-node self-play game after a few random opening moves. Positions in check, and positions whose
+// best move is a capture or promotion, are left out, as are mate scores. A found mate ends the game.
+void PlayDatagenGame(long long game, const DatagenOptions& options, std::vector<PackedPosition>& positions) {
+    std::mt19937_64 random(options.seed + static_cast<uint64_t>(game) * 0x9E3779B97F4A7C15ULL);
+    std::vector<int> moves;
+    do {
+        ParseFen("rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1");
+        for (int ply = 0; ply < options.randomPlies; ++ply) {
+            GenerateLegalMoves(moves);
+            if (moves.empty()) break;
+            MakeMove(moves[random() % moves.size()]);
+            board.ply = 0;
+        }
+    } while (BoardGameState() != "ongoing");
+    ClearHistoryTables();
+    
+    positions.clear();
+    int result = 1;
+    for (int ply = options.randomPlies; ply < options.maxPlies; ++ply) {
+        std::string state = BoardGameState();
+        if (state != "ongoing") {
+            result = (state == "draw") ? 1 : (state == "loss") ? 2 : 0;
+            break;
+        }
+        
+        search.quiet = true;
+        search.stop = false;
+        SetSearchLimits(MAX_DEPTH, -1, options.nodes);
+        SearchPosition();
+        int move = search.best;
+        if (std::abs(search.score) > MATE - MAX_DEPTH) {
+            result = ((search.score > 0) == (board.side == WHITE)) ? 2 : 0;
+            break;
+        }
+        
+        int inCheck = SqAttacked(board.pList[PCEINDEX(KINGS[board.side], 0)], board.side ^ 1);
+        if (!inCheck && CAPTURED(move) == EMPTY && PROMOTED(move) == EMPTY) {
+            positions.push_back(PackPosition(search.score, 0));
+        }
+        MakeMove(move);
+        board.ply = 0;
+    }
+    for (PackedPosition& position : positions) {
+        position.result = static_cast<uint8_t>(result);
+    }
+}
+
+// Converts a packed file to EPD lines with the score as a ce opcode and the result as c9, readable by tune
+int DumpPackedFile(const std::string& input, const std::string& output) {
+    std::ofstream outFile;
+    std::ostream* out = &std::cout;
+    if (!output.empty()) {
+        outFile.open(output, std::ios::binary);
+        if (!outFile) {
+            std::cerr << "Error: Cannot open output file: " << output << std::endl;
+            return 1;
+        }
+        out = &outFile;
+    }
+    
+    const char* const results[] = {"0-1", "1/2-1/2", "1-0"};
+    int ok = ForEachPackedPosition(input, [&](const PackedPosition& packed) {
+        UnpackPosition(packed);
+        std::string fen = BoardToFen();
+        fen.erase(fen.rfind(' ', fen.rfind(' ') - 1));
+        *out << fen << " ce " << packed.score << "; c9 \"" << results[std::min<int>(packed.result, 2)] << "\";\n";
+    });
+    if (!ok) {
+        std::cerr << "Error: Cannot open input file: " << input << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+int RunDatagen(int argc, char* argv[]) {
+    DatagenOptions options = {"", 1000, 5000, static_cast<int>(std::thread::hardware_concurrency()), 8, 400,
+                              static_cast<uint64_t>(time(nullptr))};
+    std::string dump;
+    
+    for (int i = 2; i + 1 < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--output") options.output = argv[++i];
+        else if (arg == "--games") options.games = std::atoll(argv[++i]);
+        else if (arg == "--nodes") options.nodes = std::atoll(argv[++i]);
+        else if (arg == "--jobs") options.jobs = std::atoi(argv[++i]);
+        else if (arg == "--random-plies") options.randomPlies = std::atoi(argv[++i]);
+        else if (arg == "--maxplies") options.maxPlies = std::atoi(argv[++i]);
+        else if (arg == "--seed") options.seed = std::strtoull(argv[++i], nullptr, 10);
+        else if (arg == "--dump") dump = argv[++i];
+    }
+    
+    if (!dump.empty()) return DumpPackedFile(dump, options.output);
+    if (options.output.empty()) {
+        std::cerr << "Usage: slowfish datagen --output <file.bin> [--games N] [--nodes N] [--jobs K] [--random-plies N] "
+                     "[--maxplies N] [--seed S]\n       slowfish datagen --dump <file.bin> [--output file.epd]" << std::endl;
+        return 1;
+    }
+    // Every search still pushes up to MAX_DEPTH moves onto the game history
+    options.maxPlies = std::min(options.maxPlies, MAX_GAME_MOVES - MAX_DEPTH - 1);
+    options.randomPlies = std::min(options.randomPlies, options.maxPlies);
+    
+    PackedWriter writer;
+    writer.out.open(options.output, std::ios::binary | std::ios::app);
+    if (!writer.out) {
+        std::cerr << "Error: Cannot open output file: " << options.output << std::endl;
+        return 1;
+    }
+    
+    std::atomic<long long> nextGame(0);
+    long long start = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+    long long lastReport = start;
+    
+    auto worker = [&]() {
+        std::vector<PackedPosition> positions;
+        for (long long game = nextGame++; game < options.games; game = nextGame++) {
+            PlayDatagenGame(game, options, positions);
+            WritePackedGame(writer, positions);
+            
+            std::lock_guard<std::mutex> lock(writer.mutex);
+            long long now = std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+            if (now - lastReport >= 10000) {
+                lastReport = now;
+                std::cerr << "info string datagen games " << writer.games << " positions " << writer.positions
+                          << " pps " << writer.positions * 1000 / std::max(1LL, now - start) << std::endl;
+            }
+        }
+        FreeSearchTables();
+    };
+    
+    std::vector<std::thread> threads;
+    for (int i = 0; i < std::max(1, options.jobs); ++i) {
+        threads.emplace_back(worker);
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    writer.out.close();
+    
+    long long elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count() - start;
+    std::cerr << "info string datagen games " << writer.games << " positions " << writer.positions << " time " << elapsed << std::endl;
+    return writer.out ? 0 : 1;
+}
+
+struct PgnOptions {
+    std::string input;
+    std::string output;
+    std::string format;
+    int depth;
+    long long movetime;
+    long long nodes;
+    int jobs;
+    int blunder;
+    int hashMb;
+};
+
+struct PgnGame {
+    std::vector<std::pair<std::string, std::string>> tags;
+    std::vector<int> moves;
+    std::vector<std::string> sans;
+    std::string result;
+    std::string error;        // The first move that could not be played; the game is annotated up to it
+    int startSide;
+    int startMove;
+};
+
+// Finds the next game from cursor: its tag section and movetext, up to the next tag line outside a comment
+bool NextPgnGame(const MappedFile& file, size_t& cursor, size_t& begin, size_t& end) {
+    while (cursor < file.size && isspace(static_cast<unsigned char>(file.data[cursor]))) cursor++;
+    if (cursor >= file.size) return false;
+    
+    begin = cursor;
+    int inMovetext = false;
+    int braces = 0;
+    while (cursor < file.size) {
+        const char* eol = static_cast<const char*>(memchr(file.data + cursor, '\n', file.size - cursor));
+        size_t lineEnd = (eol != nullptr) ? (eol - file.data) : file.size;
+        size_t pos = cursor;
+        while (pos < lineEnd && (file.data[pos] == ' ' || file.data[pos] == '\t')) pos++;
+        
+        if (pos < lineEnd && file.data[pos] == '[' && braces == 0) {
+            if (inMovetext) break;
+        } else {
+            for (; pos < lineEnd; ++pos) {
+                char c = file.data[pos];
+                if (c == '{') braces++;
+                else if (c == '}' && braces > 0) braces--;
+                else if (c == ';' && braces == 0) break;
+                else if (!isspace(static_cast<unsigned char>(c))) inMovetext = true;
+            }
+        }
+        cursor = lineEnd + 1;
+    }
+    end = std::min(cursor, file.size);
+    return true;
+}
+
+// Reads the tags and the main line of one game and plays the moves on the board. Comments, NAGs and
+// variations are skipped. The board is left at the last position that could be reached.
+void ParsePgnGame(const char* text, size_t length, PgnGame& game) {
+    game = PgnGame();
+    game.result = "*";
+    int started = false;
+    size_t pos = 0;
+    
+    auto start = [&]() {
+        std::string fen = "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1";
+        for (const auto& tag : game.tags) {
+            if (tag.first == "FEN") fen = tag.second;
+        }
+        ParseFen(fen);
+        if (board.pieceNum[WHITE_KING] != 1 || board.pieceNum[BLACK_KING] != 1) {
+            game.error = "FEN";
+            ParseFen("rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1");
+        }
+        game.startSide = board.side;
+        game.startMove = std::max(1, board.fullMoveCount);
+        started = true;
+    };
+    
+    while (pos < length) {
+        char c = text[pos];
+        if (isspace(static_cast<unsigned char>(c))) {
+            pos++;
+        } else if (c == '[') {
+            size_t close = pos + 1;
+            while (close < length && text[close] != ']' && text[close] != '\n') close++;
+            std::string tag(text + pos + 1, close - pos - 1);
+            size_t space = tag.find(' ');
+            size_t open = tag.find('"');
+            size_t last = tag.rfind('"');
+            if (space != std::string::npos && open != std::string::npos && last > open) {
+                std::string value;
+                for (size_t i = open + 1; i < last; ++i) {
+                    if (tag[i] == '\\' && i + 1 < last) i++;
+                    value += tag[i];
+                }
+                game.tags.emplace_back(tag.substr(0, space), value);
+                if (tag.compare(0, space, "Result") == 0) game.result = value;
+            }
+            pos = close + 1;
+        } else if (c == '{') {
+            while (pos < length && text[pos] != '}') pos++;
+            pos++;
+        } else if (c == ';' || (c == '%' && (pos == 0 || text[pos - 1] == '\n'))) {
+            while (pos < length && text[pos] != '\n') pos++;
+        } else if (c == '(') {
+            int depth = 0;
+            for (; pos < length; ++pos) {
+                if (text[pos] == '{') {
+                    while (pos < length && text[pos] != '}') pos++;
+                } else if (text[pos] == '(') {
+                    depth++;
+                } else if (text[pos] == ')' && --depth == 0) {
+                    break;
+                }
+            }
+            pos++;
+        } else {
+            size_t end = pos;
+            while (end < length && !isspace(static_cast<unsigned char>(text[end])) && strchr("{}()[];", text[end]) == nullptr) end++;
+            std::string token(text + pos, end - pos);
+            pos = std::max(end, pos + 1);
+            
+            size_t digits = 0;
+            while (digits < token.length() && isdigit(static_cast<unsigned char>(token[digits]))) digits++;
+            if (digits > 0 && digits < token.length() && token[digits] == '.') {
+                token.erase(0, token.find_first_not_of('.', digits));
+            }
+            if (token.empty() || token[0] == '$') continue;
+            if (token == "1-0" || token == "0-1" || token == "1/2-1/2" || token == "*") {
+                game.result = token;
+                break;
+            }
+            
+            if (!started) start();
+            if (!game.error.empty()) continue;
+            int move = (board.hisPly < MAX_GAME_MOVES - 1) ? ParseSan(token) : NO_MOVE;
+            if (move == NO_MOVE) {
+                game.error = token;
+                continue;
+            }
+            game.sans.push_back(PrMoveSan(move));
+            game.moves.push_back(move);
+            MakeMove(move);
+            board.ply = 0;
+        }
+    }
+    if (!started) start();
+}
+
+std::string PgnEval(int score) {
+    if (std::abs(score) > MATE - MAX_DEPTH) {
+        int mateIn = (MATE - std::abs(score) + 1) / 2;
+        return std::string(score < 0 ? "#-" : "#") + std::to_string(mateIn);
+    }
+    char text[16];
+    snprintf(text, sizeof(text), "%.2f", score / 100.0);
+    return text;
+}
+
+// Mate scores count as PGN_MATE_LOSS centipawns when comparing moves, so a slower mate is no mistake
+int PgnLossScore(int score) {
+    if (score > MATE - MAX_DEPTH) return PGN_MATE_LOSS;
+    if (score < -(MATE - MAX_DEPTH)) return -PGN_MATE_LOSS;
+    return score;
+}
+
+// Searches every position of the game from the last one back to the first, so each search finds the
+// positions that follow it in the hash table. Returns the annotated game as PGN or a JSON line.
+std::string AnnotatePgnGame(PgnGame& game, long long index, const PgnOptions& options, long long& nodes) {
+    size_t count = game.moves.size();
+    std::vector<int> scores(count + 1, 0);
+    std::vector<int> bestMoves(count + 1, NO_MOVE);
+    std::vector<std::string> bestSans(count + 1);
+    
+    ClearHistoryTables();
+    ClearPvTable();
+    search.keepHash = true;
+    for (size_t i = count + 1; i-- > 0;) {
+        if (i < count) TakeMove();
+        board.ply = 0;
+        
+        std::string state = BoardGameState();
+        if (state == "draw") continue;
+        if (state != "ongoing") {
+            scores[i] = -MATE;
+            continue;
+        }
+        search.quiet = true;
+        search.stop = false;
+        SetSearchLimits(options.depth, options.movetime, options.nodes);
+        SearchPosition();
+        nodes += search.nodes;
+        scores[i] = search.score;
+        bestMoves[i] = search.best;
+        if (search.best != NO_MOVE) bestSans[i] = PrMoveSan(search.best);
+    }
+    search.keepHash = false;
+    
+    std::vector<int> losses(count, 0);
+    std::vector<std::string> flags(count);
+    std::vector<int> whiteScores(count);
+    for (size_t i = 0; i < count; ++i) {
+        int mover = (game.startSide + static_cast<int>(i)) % 2;
+        losses[i] = std::max(0, PgnLossScore(scores[i]) + PgnLossScore(scores[i + 1]));
+        if (game.moves[i] == bestMoves[i]) losses[i] = 0;
+        if (losses[i] >= options.blunder) flags[i] = "??";
+        else if (losses[i] >= options.blunder / 2) flags[i] = "?";
+        whiteScores[i] = (mover == BLACK) ? scores[i + 1] : -scores[i + 1];
+    }
+    
+    std::string text;
+    if (options.format == "jsonl") {
+        text = "{\"game\":" + std::to_string(index + 1) + ",\"headers\":{";
+        for (size_t t = 0; t < game.tags.size(); ++t) {
+            if (t > 0) text += ',';
+            text += "\"" + JsonEscape(game.tags[t].first) + "\":\"" + JsonEscape(game.tags[t].second) + "\"";
+        }
+        text += "},\"moves\":[";
+        for (size_t i = 0; i < count; ++i) {
+            std::string scoreType = "cp";
+            int scoreValue = whiteScores[i];
+            if (std::abs(scoreValue) > MATE - MAX_DEPTH) {
+                scoreType = "mate";
+                scoreValue = (MATE - std::abs(whiteScores[i]) + 1) / 2;
+                if (whiteScores[i] < 0) scoreValue = -scoreValue;
+            }
+            if (i > 0) text += ',';
+            text += "{\"ply\":" + std::to_string(i + 1) + ",\"san\":\"" + game.sans[i] + "\",\"uci\":\"" + PrMove(game.moves[i]) + "\"";
+            text += ",\"score\":{\"" + scoreType + "\":" + std::to_string(scoreValue) + "}";
+            text += ",\"best\":\"" + (bestMoves[i] != NO_MOVE ? PrMove(bestMoves[i]) : std::string()) + "\"";
+            text += ",\"loss\":" + std::to_string(losses[i]) + ",\"flag\":\"" + flags[i] + "\"}";
+        }
+        text += "],\"result\":\"" + JsonEscape(game.result) + "\"";
+        if (!game.error.empty()) text += ",\"error\":\"" + JsonEscape(game.error) + "\"";
+        return text + "}\n";
+    }
+    
+    for (const auto& tag : game.tags) {
+        std::string value;
+        for (char c : tag.second) {
+            if (c == '"' || c == '\\') value += '\\';
+            value += c;
+        }
+        text += "[" + tag.first + " \"" + value + "\"]\n";
+    }
+    text += "[Annotator \"Slowfish depth " + std::to_string(options.depth) + "\"]\n\n";
+    
+    std::string line;
+    auto add = [&](const std::string& word) {
+        if (!line.empty() && line.length() + 1 + word.length() > 79) {
+            text += line + "\n";
+            line.clear();
+        }
+        if (!line.empty()) line += ' ';
+        line += word;
+    };
+    
+    // Every move has a comment, so black moves always repeat the move number
+    for (size_t i = 0; i < count; ++i) {
+        int mover = (game.startSide + static_cast<int>(i)) % 2;
+        int moveNumber = game.startMove + (static_cast<int>(i) + (game.startSide == BLACK)) / 2;
+        if (mover == WHITE) add(std::to_string(moveNumber) + ".");
+        else add(std::to_string(moveNumber) + "...");
+        add(game.sans[i] + flags[i]);
+        
+        if (std::abs(whiteScores[i]) != MATE) {
+            std::string comment = "{[%eval " + PgnEval(whiteScores[i]) + "]";
+            if (!flags[i].empty() && !bestSans[i].empty()) comment += " " + bestSans[i] + " was best";
+            add(comment + "}");
+        }
+    }
+    if (!game.error.empty()) add("{Cannot play " + game.error + "}");
+    add(game.result);
+    return text + line + "\n\n";
+}
+
+int RunPgn(int argc, char* argv[]) {
+    PgnOptions options = {"", "", "", 8, -1, 0, static_cast<int>(std::thread::hardware_concurrency()), 200, 16};
+    
+    for (int i = 2; i + 1 < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--input") options.input = argv[++i];
+        else if (arg == "--output") options.output = argv[++i];
+        else if (arg == "--format") options.format = argv[++i];
+        else if (arg == "--depth") options.depth = std::atoi(argv[++i]);
+        else if (arg == "--movetime") options.movetime = std::atoll(argv[++i]);
+        else if (arg == "--nodes") options.nodes = std::atoll(argv[++i]);
+        else if (arg == "--jobs") options.jobs = std::atoi(argv[++i]);
+        else if (arg == "--blunder") options.blunder = std::atoi(argv[++i]);
+        else if (arg == "--hash") options.hashMb = std::atoi(argv[++i]);
+    }
+    
+    if (options.input.empty()) {
+        std::cerr << "Usage: slowfish pgn --input <games.pgn> [--output file] [--format pgn|jsonl] [--depth N] [--movetime ms] "
+                     "[--nodes N] [--jobs K] [--blunder cp] [--hash MB]" << std::endl;
+        return 1;
+    }
+    options.depth = std::max(1, std::min(options.depth, MAX_DEPTH));
+    options.jobs = std::max(1, options.jobs);
+    options.blunder = std::max(2, options.blunder);
+    options.hashMb = std::max(1, std::min(options.hashMb, MAX_HASH_MB));
+    if (options.format.empty()) {
+        bool jsonName = options.output.length() >= 6 && options.output.substr(options.output.length() - 6) == ".jsonl";
+        options.format = jsonName ? "jsonl" : "pgn";
+    }
+    
+    MappedFile file;
+    if (!MapFile(options.input, file)) {
+        std::cerr << "Error: Cannot open input file: " << options.input << std::endl;
+        return 1;
+    }
+    
+    std::ofstream outFile;
+    std::ostream* out = &std::cout;
+    if (!options.output.empty()) {
+        outFile.open(options.output, std::ios::binary);
+        if (!outFile) {
+            std::cerr << "Error: Cannot open output file: " << options.output << std::endl;
+            UnmapFile(file);
+            return 1;
+        }
+        out = &outFile;
+    }
+    
+    // Games are claimed one at a time while scanning, so annotation starts before the whole file is read
+    std::mutex inputMutex;
+    size_t cursor = 0;
+    long long nextGame = 0;
+    std::mutex outputMutex;
+    std::map<long long, std::string> pending;
+    long long nextToWrite = 0;
+    std::atomic<long long> moves(0);
+    std::atomic<long long> totalNodes(0);
+    std::atomic<long long> errors(0);
+    long long start = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+    
+    auto worker = [&]() {
+        BindSearchThread();
+        search.hashMb = options.hashMb;
+        PgnGame game;
+        while (true) {
+            size_t begin;
+            size_t end;
+            long long index;
+            {
+                std::lock_guard<std::mutex> lock(inputMutex);
+                if (!NextPgnGame(file, cursor, begin, end)) break;
+                index = nextGame++;
+            }
+            
+            ParsePgnGame(file.data + begin, end - begin, game);
+            long long nodes = 0;
+            std::string text = AnnotatePgnGame(game, index, options, nodes);
+            moves += game.moves.size();
+            totalNodes += nodes;
+            if (!game.error.empty()) errors++;
+            
+            std::lock_guard<std::mutex> lock(outputMutex);
+            pending[index] = std::move(text);
+            while (!pending.empty() && pending.begin()->first == nextToWrite) {
+                *out << pending.begin()->second;
+                pending.erase(pending.begin());
+                nextToWrite++;
+            }
+        }
+        FreeSearchTables();
+    };
+    
+    std::vector<std::thread> workers;
+    for (int i = 0; i < options.jobs; ++i) {
+        workers.emplace_back(worker);
+    }
+    for (std::thread& t : workers) {
+        t.join();
+    }
+    out->flush();
+    UnmapFile(file);
+    
+    long long elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count() - start;
+    std::cerr << "info string annotated " << nextGame << " games moves " << moves << " errors " << errors
+              << " nodes " << totalNodes << " time " << elapsed << " jobs " << options.jobs << std::endl;
+    return 0;
+}
+
+#ifndef _WIN32
+// Addresses are "unix:<path>" for a Unix domain socket, otherwise "[host:]port" for TCP (host defaults to localhost)
+int OpenSocket(const std::string& address, int listening) {
+    if (address.compare(0, 5, "unix:") == 0) {
+        std::string path = address.substr(5);
+        sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (path.empty() || path.size() >= sizeof(addr.sun_path)) return -1;
+        strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+        
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0) return -1;
+        if (listening) unlink(path.c_str());
+        int ok = listening ? (bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0 && listen(fd, SOMAXCONN) == 0)
+                           : (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0);
+        if (!ok) {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+    
+    std::string host = listening ? "0.0.0.0" : "127.0.0.1";
+    std::string port = address;
+    size_t colon = address.rfind(':');
+    if (colon != std::string::npos) {
+        host = address.substr(0, colon);
+        port = address.substr(colon + 1);
+    }
+    
+    addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = listening ? AI_PASSIVE : 0;
+    addrinfo* results = nullptr;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &results) != 0) return -1;
+    
+    int fd = -1;
+    for (addrinfo* ai = results; ai != nullptr && fd < 0; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0) continue;
+        
+        int ok;
+        if (listening) {
+            int reuse = 1;
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+            ok = bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, SOMAXCONN) == 0;
+        } else {
+            ok = connect(fd, ai->ai_addr, ai->ai_addrlen) == 0;
+        }
+        if (!ok) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(results);
+    return fd;
+}
+
+void SendLine(int fd, const std::string& line) {
+    std::string data = line + "\n";
+    size_t sent = 0;
+    while (sent < data.size()) {
+        ssize_t written = write(fd, data.data() + sent, data.size() - sent);
+        if (written <= 0) return;
+        sent += written;
+    }
+}
+
+// Serves one coordinator connection at a time, running the normal UCI loop with the socket as stdin/stdout
+int RunWorker(int argc, char* argv[]) {
+    if (argc < 3) {
+        std::cerr << "Usage: slowfish worker <[host:]port|unix:path>" << std::endl;
+        return 1;
+    }
+    
+    int listener = OpenSocket(argv[2], true);
+    if (listener < 0) {
+        std::cerr << "Error: Cannot listen on " << argv[2] << std::endl;
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    clusterWorker = true;
+    
+    for (;;) {
+        int connection = accept(listener, nullptr, nullptr);
+        if (connection < 0) continue;
+        
+        dup2(connection, STDIN_FILENO);
+        dup2(connection, STDOUT_FILENO);
+        close(connection);
+        
+        clearerr(stdin);
+        std::cin.clear();
+        UciLoop();
+        
+        // Point stdin/stdout away from the socket so the connection really closes
+        std::cout.flush();
+        int devNull = open("/dev/null", O_RDWR);
+        dup2(devNull, STDIN_FILENO);
+        dup2(devNull, STDOUT_FILENO);
+        close(devNull);
+    }
+}
+
+struct ClusterNode {
+    int fd;
+    std::thread reader;
+    int searching;
+    int depth;
+    int score;          // Mate scores are mapped to +-(MATE - plies) so they compare with centipawns
+    std::string bestMove;
+};
+
+// A UCI front end that splits the root moves of each go between the workers with searchmoves and relays the
+// PV table entries that workers publish to all the other workers
+int RunCluster(int argc, char* argv[]) {
+    if (argc < 3) {
+        std::cerr << "Usage: slowfish cluster <address> [<address> ...]" << std::endl;
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    
+    std::vector<ClusterNode> nodes(argc - 2);
+    for (int i = 2; i < argc; ++i) {
+        nodes[i - 2].fd = OpenSocket(argv[i], false);
+        if (nodes[i - 2].fd < 0) {
+            std::cerr << "Error: Cannot connect to worker " << argv[i] << std::endl;
+            return 1;
+        }
+        nodes[i - 2].searching = false;
+    }
+    
+    std::mutex clusterMutex;
+    int pending = 0;
+    
+    auto reader = [&](size_t self) {
+        ClusterNode& node = nodes[self];
+        FILE* in = fdopen(dup(node.fd), "r");
+        char* buffer = nullptr;
+        size_t capacity = 0;
+        ssize_t length;
+        
+        while (in != nullptr && (length = getline(&buffer, &capacity, in)) > 0) {
+            std::string line(buffer, length);
+            while (!line.empty() && (line.back() == '\n' || line.back() == '\r')) line.pop_back();
+            std::istringstream iss(line);
+            std::string token;
+            iss >> token;
+            
+            std::lock_guard<std::mutex> lock(clusterMutex);
+            if (line.compare(0, 22, "info string hashstore ") == 0) {
+                for (size_t other = 0; other < nodes.size(); ++other) {
+                    if (other != self) SendLine(nodes[other].fd, line.substr(12));
+                }
+            } else if (token == "bestmove") {
+                iss >> node.bestMove;
+                if (!node.searching) continue;
+                node.searching = false;
+                
+                if (--pending == 0) {
+                    const ClusterNode* best = nullptr;
+                    for (const ClusterNode& candidate : nodes) {
+                        if (candidate.bestMove.empty() || candidate.bestMove == "0000") continue;
+                        if (best == nullptr || candidate.score > best->score) best = &candidate;
+                    }
+                    WriteLine("bestmove " + (best != nullptr ? best->bestMove : node.bestMove));
+                }
+            } else if (token == "info" && line.find(" score ") != std::string::npos) {
+                std::string kind;
+                int value = 0;
+                while (iss >> token) {
+                    if (token == "depth") iss >> node.depth;
+                    if (token == "score") iss >> kind >> value;
+                }
+                node.score = (kind == "mate") ? (value > 0 ? MATE - 2 * value + 1 : -MATE - 2 * value) : value;
+                
+                // Only pass on lines from the worker that currently holds the best move
+                int leading = true;
+                for (const ClusterNode& other : nodes) {
+                    if (other.depth > 0 && &other != &node && other.score > node.score) leading = false;
+                }
+                if (leading) WriteLine(line);
+            } else if (token == "info" && line.find(" currmove ") == std::string::npos) {
+                WriteLine(line);
+            }
+        }
+        free(buffer);
+        if (in != nullptr) fclose(in);
+    };
+    
+    for (size_t index = 0; index < nodes.size(); ++index) {
+        nodes[index].reader = std::thread(reader, index);
+    }
+    
+    auto broadcast = [&](const std::string& line) {
+        for (ClusterNode& node : nodes) {
+            SendLine(node.fd, line);
+        }
+    };
+    
+    std::string command;
+    while (std::getline(std::cin, command)) {
+        std::istringstream iss(command);
+        std::string token;
+        iss >> token;
+        
+        if (token == "uci") {
+            HandleUci();
+        } else if (token == "isready") {
+            HandleIsReady();
+        } else if (token == "position" || token == "ucinewgame") {
+            ParseUciCommand(command);
+            broadcast(command);
+        } else if (token == "go") {
+            // The coordinator's own board has the root moves; they are dealt out round-robin in move generator order
+            std::string limits = "go";
+            std::vector<int> searchMoves;
+            int readingMoves = false;
+            while (iss >> token) {
+                if (token == "searchmoves") {
+                    readingMoves = true;
+                    continue;
+                }
+                if (readingMoves) {
+                    int move = ParseUciMove(token);
+                    if (move != NO_MOVE) {
+                        searchMoves.push_back(move);
+                        continue;
+                    }
+                    readingMoves = false;
+                }
+                limits += " " + token;
+            }
+            
+            SetSearchLimits(MAX_DEPTH, -1, 0);
+            search.searchMoveNum = static_cast<int>(searchMoves.size());
+            std::copy(searchMoves.begin(), searchMoves.end(), search.searchMoves);
+            InitRootMoves();
+            
+            std::vector<std::string> assigned(nodes.size());
+            for (int index = 0; index < search.rootMoveNum; ++index) {
+                assigned[index % nodes.size()] += " " + PrMove(search.rootMoves[index].line.moves[0]);
+            }
+            
+            std::lock_guard<std::mutex> lock(clusterMutex);
+            for (size_t index = 0; index < nodes.size(); ++index) {
+                ClusterNode& node = nodes[index];
+                node.depth = 0;
+                node.score = -INFINITE;
+                node.bestMove.clear();
+                if (assigned[index].empty() && !(index == 0 && search.rootMoveNum == 0)) continue;
+                
+                node.searching = true;
+                pending++;
+                SendLine(node.fd, limits + (assigned[index].empty() ? "" : " searchmoves" + assigned[index]));
+            }
+        } else if (token == "quit") {
+            break;
+        } else if (!token.empty()) {
+            broadcast(command);
+        }
+    }
+    
+    broadcast("quit");
+    for (ClusterNode& node : nodes) {
+        shutdown(node.fd, SHUT_RDWR);
+        node.reader.join();
+        close(node.fd);
+    }
+    return 0;
+}
+
+// A go command with the session's position and options as they were when it arrived
+struct ServerRequest {
+    long long id;
+    long long arrival;
+    std::string position;
+    std::string go;
+    int multiPv;
+};
+
+// One client connection with its own position and options. Requests carry snapshots of both, so any pool
+// thread can search them. The socket is closed when the last reference to the session goes away.
+struct ServerSession {
+    int fd;
+    std::mutex writeMutex;
+    std::string input;
+    std::string position = "position startpos";
+    int multiPv = 1;
+    std::deque<ServerRequest> requests;
+    long long lastRequest = 0;
+    long long stopBefore = 0;
+    int scheduled = false;          // In the run queue or being searched
+    Search* running = nullptr;      // Search state of the pool thread searching this session
+    
+    ~ServerSession() {
+        close(fd);
+    }
+    
+    void Send(const std::string& line) {
+        std::lock_guard<std::mutex> lock(writeMutex);
+        SendLine(fd, line);
+    }
+};
+
+struct Server {
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::deque<std::shared_ptr<ServerSession>> runQueue;   // Sessions with waiting requests, served round-robin
+    long long budget;
+    int mateHashMb;                                         // Mate table of every go mate, not settable by clients
+};
+
+// Pool threads share the server's hash table and search one request at a time. A session goes to the back of
+// the run queue after each request, so a session that queues many searches cannot hold up the others.
+void ServerThread(Server& server, Board::PvEntry* table, size_t entries) {
+    BindSearchThread();
+    UsePvTable(table, entries);
+    search.keepHash = true;
+    search.moveTimeCap = server.budget;
+    search.mateHashMb = server.mateHashMb;
+    
+    std::unique_lock<std::mutex> lock(server.mutex);
+    for (;;) {
+        server.wake.wait(lock, [&server]() { return !server.runQueue.empty(); });
+        std::shared_ptr<ServerSession> session = server.runQueue.front();
+        server.runQueue.pop_front();
+        ServerRequest request = session->requests.front();
+        session->requests.pop_front();
+        session->running = &search;
+        search.stop = (request.id <= session->stopBefore);
+        lock.unlock();
+        
+        long long now = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+        outputCallback = [&session](const std::string& line) { session->Send(line); };
+        search.multiPv = request.multiPv;
+        search.queuedTime = now - request.arrival;
+        HandlePosition(request.position);
+        HandleGo(request.go);
+        outputCallback = nullptr;
+        
+        lock.lock();
+        session->running = nullptr;
+        if (session->requests.empty()) {
+            session->scheduled = false;
+        } else {
+            server.runQueue.push_back(session);
+        }
+    }
+}
+
+// Stops the session's running search and everything it has queued; the stopped searches still answer bestmove
+void StopServerSession(Server& server, ServerSession& session) {
+    std::lock_guard<std::mutex> lock(server.mutex);
+    session.stopBefore = session.lastRequest;
+    if (session.running != nullptr) session.running->stop = true;
+}
+
+// Commands that only change the session are answered on the I/O thread; go is queued for the pool.
+// Returns false when the client quits.
+int HandleServerCommand(Server& server, const std::shared_ptr<ServerSession>& session, const std::string& command) {
+    std::istringstream iss(command);
+    std::string token;
+    iss >> token;
+    
+    if (token == "uci") {
+        session->Send("id name slowfish");
+        session->Send("option name MultiPV type spin default 1 min 1 max " + std::to_string(MAX_MULTI_PV));
+        session->Send("uciok");
+    } else if (token == "isready") {
+        session->Send("readyok");
+    } else if (token == "ucinewgame") {
+        session->position = "position startpos";
+    } else if (token == "position") {
+        session->position = command;
+    } else if (token == "setoption") {
+        std::string name;
+        std::string value;
+        if (!ParseSetOption(command, name, value)) return true;
+        if (name == "multipv") {
+            session->multiPv = std::max(1, std::min(std::atoi(value.c_str()), MAX_MULTI_PV));
+        } else {
+            session->Send("info string option " + name + " is not available per session");
+        }
+    } else if (token == "go") {
+        std::lock_guard<std::mutex> lock(server.mutex);
+        long long now = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+        session->requests.push_back({++session->lastRequest, now, session->position, command, session->multiPv});
+        if (!session->scheduled) {
+            session->scheduled = true;
+            server.runQueue.push_back(session);
+            server.wake.notify_one();
+        }
+    } else if (token == "stop") {
+        StopServerSession(server, *session);
+    } else if (token == "quit") {
+        return false;
+    } else if (!token.empty()) {
+        session->Send("info string unknown command " + token);
+    }
+    return true;
+}
+
+// Many UCI sessions over one listening socket. A single I/O thread reads every connection, and a fixed pool of
+// search threads with one shared hash table runs the searches they ask for.
+int RunServer(int argc, char* argv[]) {
+    std::string address;
+    int threads = static_cast<int>(std::thread::hardware_concurrency());
+    int hashMb = DEFAULT_SERVER_HASH_MB;
+    long long budget = DEFAULT_SERVER_BUDGET_MS;
+    int mateHashMb = DEFAULT_MATE_HASH_MB;
+    for (int i = 2; i + 1 < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--listen") address = argv[++i];
+        else if (arg == "--threads") threads = std::atoi(argv[++i]);
+        else if (arg == "--hash") hashMb = std::atoi(argv[++i]);
+        else if (arg == "--budget") budget = std::atoll(argv[++i]);
+        else if (arg == "--mate-hash") mateHashMb = std::atoi(argv[++i]);
+    }
+    if (address.empty()) {
+        std::cerr << "Usage: slowfish server --listen <[host:]port|unix:path> [--threads N] [--hash MB] [--budget ms] "
+                     "[--mate-hash MB]" << std::endl;
+        return 1;
+    }
+    threads = std::max(1, threads);
+    
+    int listener = OpenSocket(address, true);
+    if (listener < 0) {
+        std::cerr << "Error: Cannot listen on " << address << std::endl;
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    
+    // The I/O thread owns the shared table; pool threads only borrow it and never clear or free it
+    search.hashMb = std::max(1, std::min(hashMb, MAX_HASH_MB));
+    ClearPvTable();
+    Server server;
+    server.budget = std::max(0LL, budget);
+    server.mateHashMb = std::max(1, std::min(mateHashMb, MAX_MATE_HASH_MB));
+    std::vector<std::thread> pool;
+    for (int i = 0; i < threads; ++i) {
+        pool.emplace_back(ServerThread, std::ref(server), board.PvTable, board.PvTableEntries);
+    }
+    std::cerr << "info string server listening on " << address << " with " << threads << " threads and "
+              << board.PvTableEntries * sizeof(Board::PvEntry) / (1024 * 1024) << " MB hash" << std::endl;
+    
+    std::map<int, std::shared_ptr<ServerSession>> sessions;
+    std::vector<pollfd> fds;
+    for (;;) {
+        fds.assign(1, {listener, POLLIN, 0});
+        for (const auto& entry : sessions) {
+            fds.push_back({entry.first, POLLIN, 0});
+        }
+        if (poll(fds.data(), fds.size(), -1) < 0) continue;
+        
+        if (fds[0].revents & POLLIN) {
+            int fd = accept(listener, nullptr, nullptr);
+            if (fd >= 0) {
+                std::shared_ptr<ServerSession> session = std::make_shared<ServerSession>();
+                session->fd = fd;
+                sessions[fd] = session;
+            }
+        }
+        
+        for (size_t i = 1; i < fds.size(); ++i) {
+            if (fds[i].revents == 0) continue;
+            std::shared_ptr<ServerSession> session = sessions[fds[i].fd];
+            char buffer[4096];
+            ssize_t length = read(fds[i].fd, buffer, sizeof(buffer));
+            int open = length > 0;
+            if (open) session->input.append(buffer, length);
+            
+            size_t newline;
+            while (open && (newline = session->input.find('\n')) != std::string::npos) {
+                std::string command = session->input.substr(0, newline);
+                session->input.erase(0, newline + 1);
+                if (!command.empty() && command.back() == '\r') command.pop_back();
+                open = HandleServerCommand(server, session, command);
+            }
+            if (!open) {
+                StopServerSession(server, *session);
+                sessions.erase(fds[i].fd);
+            }
+        }
+    }
+}
+#else
+int RunWorker(int, char*[]) {
+    std::cerr << "Error: Cluster workers are only supported on POSIX systems" << std::endl;
+    return 1;
+}
+
+int RunCluster(int, char*[]) {
+    std::cerr << "Error: Cluster search is only supported on POSIX systems" << std::endl;
+    return 1;
+}
+
+int RunServer(int, char*[]) {
+    std::cerr << "Error: Server mode is only supported on POSIX systems" << std::endl;
+    return 1;
+}
+#endif
+
+// Rewrites the cache file with only the best record per position. Writers are held off by the file lock,
+// and readers and writers that still have the old file open switch to the new one by its inode.
+int RunCacheTool(int argc, char* argv[]) {
+    if (argc < 4 || std::string(argv[2]) != "compact") {
+        std::cerr << "Usage: slowfish cache compact <file>" << std::endl;
+        return 1;
+    }
+#ifndef _WIN32
+    std::string path = argv[3];
+    std::shared_ptr<AnalysisCache> cache = OpenAnalysisCache(path);
+    if (!cache) {
+        std::cerr << "Error: Cannot open analysis cache: " << path << std::endl;
+        return 1;
+    }
+    
+    std::lock_guard<std::mutex> lock(cache->mutex);
+    flock(cache->fd, LOCK_EX);
+    RefreshCache(*cache);
+    size_t before = (cache->mappedSize - CACHE_HEADER_SIZE) / sizeof(CacheRecord);
+    
+    std::string temporary = path + ".compact";
+    std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+    char header[CACHE_HEADER_SIZE] = {};
+    memcpy(header, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    out.write(header, sizeof(header));
+    
+    std::vector<size_t> offsets;
+    for (const auto& entry : cache->index) {
+        offsets.push_back(entry.second);
+    }
+    std::sort(offsets.begin(), offsets.end());
+    for (size_t offset : offsets) {
+        out.write(cache->data + offset, sizeof(CacheRecord));
+    }
+    out.close();
+    
+    int ok = static_cast<bool>(out) && rename(temporary.c_str(), path.c_str()) == 0;
+    flock(cache->fd, LOCK_UN);
+    if (!ok) {
+        std::cerr << "Error: Cannot write compacted cache: " << temporary << std::endl;
+        unlink(temporary.c_str());
+        return 1;
+    }
+    std::cerr << "info string compacted " << before << " records to " << offsets.size() << std::endl;
+    return 0;
+#else
+    std::cerr << "Error: The analysis cache is only supported on POSIX systems" << std::endl;
+    return 1;
+#endif
+}
+
+struct TraceDepthSummary {
+    long long nodes;
+    long long cutoffs;
+    long long cutoffIndex[6];     // First to fourth move, fifth to eighth, ninth and later
+    long long cutoffKinds[TRACE_KIND_COUNT];
+    long long repeated;
+};
+
+struct TraceRootSummary {
+    long long searches;
+    long long nodes;
+};
+
+inline double TracePercent(long long part, long long whole) {
+    return whole > 0 ? 100.0 * part / whole : 0.0;
+}
+
+// Summarises a trace file: where the fail highs came in the move list and what kind of move caused them, per depth,
+// the nodes spent under each root move, and positions searched again at the same depth within one iteration
+int RunTraceTool(int argc, char* argv[]) {
+    if (argc < 3) {
+        std::cerr << "Usage: slowfish trace <file>" << std::endl;
+        return 1;
+    }
+    MappedFile file;
+    if (!MapFile(argv[2], file) || file.size < sizeof(TRACE_MAGIC) || memcmp(file.data, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0) {
+        std::cerr << "Error: Cannot read trace file: " << argv[2] << std::endl;
+        UnmapFile(file);
+        return 1;
+    }
+    
+    size_t count = (file.size - sizeof(TRACE_MAGIC)) / sizeof(TraceRecord);
+    std::map<int, TraceDepthSummary> depths;
+    std::map<uint32_t, TraceRootSummary> rootMoves;
+    std::unordered_set<uint64_t> searched;
+    long long qnodes = 0;
+    long long rootNodes = 0;
+    int searches = 0;
+    int iteration = -1;
+    int deepestIteration = 0;
+    
+    for (size_t index = 0; index < count; ++index) {
+        TraceRecord record;
+        memcpy(&record, file.data + sizeof(TRACE_MAGIC) + index * sizeof(TraceRecord), sizeof(record));
+        
+        // Iterations only grow within a search, so a smaller one starts the next search
+        if (record.iteration != iteration) {
+            if (record.iteration < iteration || iteration < 0) searches++;
+            iteration = record.iteration;
+            deepestIteration = std::max(deepestIteration, iteration);
+            searched.clear();
+        }
+        
+        TraceDepthSummary& summary = depths[record.depth];
+        summary.nodes++;
+        if (record.cutoff != 0) {
+            int bucket = record.cutoff <= 4 ? record.cutoff - 1 : (record.cutoff <= 8 ? 4 : 5);
+            summary.cutoffs++;
+            summary.cutoffIndex[bucket]++;
+            summary.cutoffKinds[(record.flags >> 4) & 7]++;
+        }
+        if (record.flags & TRACE_QSEARCH) {
+            qnodes++;
+        } else if (!(record.flags & TRACE_NULL) &&
+                   !searched.insert((static_cast<uint64_t>(record.key) << 8) | static_cast<uint8_t>(record.depth)).second) {
+            summary.repeated++;
+        }
+        if (record.ply == 1 && !(record.flags & TRACE_NULL)) {
+            rootMoves[record.move].searches++;
+            rootMoves[record.move].nodes += record.nodes;
+            rootNodes += record.nodes;
+        }
+    }
+    UnmapFile(file);
+    
+    std::cout << "trace " << argv[2] << ": " << count << " nodes (" << qnodes << " quiescence) in " << searches
+              << " searches, deepest iteration " << deepestIteration << std::endl << std::endl;
+    
+    char line[200];
+    std::cout << "cutoffs by depth, as a share of the cutoffs at that depth" << std::endl;
+    snprintf(line, sizeof(line), "%5s %11s %10s %6s %6s %6s %6s %6s %6s %7s %7s %7s %7s %7s %9s", "depth", "nodes", "cutoffs",
+             "1st", "2nd", "3rd", "4th", "5-8", "9+", "hash", "capture", "killer", "counter", "quiet", "repeated");
+    std::cout << line << std::endl;
+    for (const auto& entry : depths) {
+        const TraceDepthSummary& summary = entry.second;
+        std::string depth = entry.first == 0 ? "q" : std::to_string(entry.first);
+        int length = snprintf(line, sizeof(line), "%5s %11lld %10lld", depth.c_str(), summary.nodes, summary.cutoffs);
+        for (int bucket = 0; bucket < 6; ++bucket) {
+            length += snprintf(line + length, sizeof(line) - length, " %5.1f%%", TracePercent(summary.cutoffIndex[bucket], summary.cutoffs));
+        }
+        for (int kind = TRACE_KIND_HASH; kind < TRACE_KIND_COUNT; ++kind) {
+            length += snprintf(line + length, sizeof(line) - length, " %6.1f%%", TracePercent(summary.cutoffKinds[kind], summary.cutoffs));
+        }
+        snprintf(line + length, sizeof(line) - length, " %8.1f%%", TracePercent(summary.repeated, summary.nodes));
+        std::cout << line << std::endl;
+    }
+    
+    std::vector<std::pair<uint32_t, TraceRootSummary>> roots(rootMoves.begin(), rootMoves.end());
+    std::sort(roots.begin(), roots.end(), [](const std::pair<uint32_t, TraceRootSummary>& a, const std::pair<uint32_t, TraceRootSummary>& b) {
+        return a.second.nodes > b.second.nodes;
+    });
+    std::cout << std::endl << "nodes per root move" << std::endl;
+    snprintf(line, sizeof(line), "%-6s %9s %12s %7s", "move", "searches", "nodes", "share");
+    std::cout << line << std::endl;
+    for (const auto& root : roots) {
+        snprintf(line, sizeof(line), "%-6s %9lld %12lld %6.1f%%", PrMove(static_cast<int>(root.first)).c_str(), root.second.searches,
+                 root.second.nodes, TracePercent(root.second.nodes, rootNodes));
+        std::cout << line << std::endl;
+    }
+    return 0;
+}
+
+// One side of a match: an in-process Engine configured through setoption, or an external UCI binary on pipes
+struct MatchPlayer {
+    std::unique_ptr<Engine> engine;
+    std::mutex mutex;
+    std::condition_variable received;
+    std::deque<std::string> lines;
+    int toEngine = -1;
+    FILE* fromEngine = nullptr;
+    int pid = -1;
+};
+
+void SendToPlayer(MatchPlayer& player, const std::string& line) {
+    if (player.engine) {
+        player.engine->uci(line, [&player](const std::string& output) {
+            std::lock_guard<std::mutex> lock(player.mutex);
+            player.lines.push_back(output);
+            player.received.notify_one();
+        });
+    }
+#ifndef _WIN32
+    else {
+        SendLine(player.toEngine, line);
+    }
+#endif
+}
+
+// Returns false once an external engine has exited
+int ReadFromPlayer(MatchPlayer& player, std::string& line) {
+    if (player.engine) {
+        std::unique_lock<std::mutex> lock(player.mutex);
+        player.received.wait(lock, [&player]() { return !player.lines.empty(); });
+        line = std::move(player.lines.front());
+        player.lines.pop_front();
+        return true;
+    }
+#ifndef _WIN32
+    char* buffer = nullptr;
+    size_t capacity = 0;
+    ssize_t length = getline(&buffer, &capacity, player.fromEngine);
+    line.assign(buffer != nullptr && length > 0 ? buffer : "", length > 0 ? length : 0);
+    free(buffer);
+    while (!line.empty() && (line.back() == '\n' || line.back() == '\r')) line.pop_back();
+    return length > 0;
+#else
+    return false;
+#endif
+}
+
+int WaitForPlayer(MatchPlayer& player, const std::string& prefix, std::string& line) {
+    while (ReadFromPlayer(player, line)) {
+        if (line.compare(0, prefix.size(), prefix) == 0) return true;
+    }
+    return false;
+}
+
+// An empty command starts an in-process engine. Options are "name=value" pairs sent as setoption.
+int StartPlayer(MatchPlayer& player, const std::string& command, const std::vector<std::string>& options) {
+    if (command.empty()) {
+        player.engine.reset(new Engine());
+    } else {
+#ifndef _WIN32
+        int input[2];
+        int output[2];
+        if (pipe(input) != 0) return false;
+        if (pipe(output) != 0) {
+            close(input[0]);
+            close(input[1]);
+            return false;
+        }
+        // Players are started one after another, so later children do not inherit earlier players' pipes
+        fcntl(input[1], F_SETFD, FD_CLOEXEC);
+        fcntl(output[0], F_SETFD, FD_CLOEXEC);
+        
+        player.pid = fork();
+        if (player.pid == 0) {
+            dup2(input[0], STDIN_FILENO);
+            dup2(output[1], STDOUT_FILENO);
+            close(input[0]);
+            close(output[1]);
+            execl("/bin/sh", "sh", "-c", command.c_str(), static_cast<char*>(nullptr));
+            _exit(127);
+        }
+        close(input[0]);
+        close(output[1]);
+        player.toEngine = input[1];
+        player.fromEngine = fdopen(output[0], "r");
+        if (player.pid < 0 || player.fromEngine == nullptr) return false;
+#else
+        return false;
+#endif
+    }
+    
+    std::string line;
+    SendToPlayer(player, "uci");
+    if (!WaitForPlayer(player, "uciok", line)) return false;
+    for (const std::string& option : options) {
+        size_t equals = option.find('=');
+        SendToPlayer(player, "setoption name " + option.substr(0, equals) +
+                             (equals != std::string::npos ? " value " + option.substr(equals + 1) : ""));
+    }
+    SendToPlayer(player, "isready");
+    return WaitForPlayer(player, "readyok", line);
+}
+
+void StopPlayer(MatchPlayer& player) {
+    SendToPlayer(player, "quit");
+    player.engine.reset();
+#ifndef _WIN32
+    if (player.fromEngine != nullptr) {
+        close(player.toEngine);
+        fclose(player.fromEngine);
+        waitpid(player.pid, nullptr, 0);
+        player.fromEngine = nullptr;
+    }
+#endif
+}
+
+struct MatchOptions {
+    std::string engines[2];                 // Commands of external engines, empty for the built-in engine
+    std::vector<std::string> options[2];
+    std::string openings;
+    int games;
+    int concurrency;
+    long long baseTime;                     // Milliseconds per game
+    long long increment;                    // Milliseconds per move
+    long long nodes;                        // Plays fixed-node games instead when positive
+    int maxPlies;
+    double elo0;
+    double elo1;
+    double alpha;
+    double beta;
+};
+
+// Plays one game from the opening with players[0] to move first, and returns players[0]'s score in half points.
+// Games end with getGameState's rules: checkmate, stalemate, threefold repetition, the fifty-move rule and dead material.
+int PlayMatchGame(MatchPlayer* players[2], const std::string& fen, const MatchOptions& options) {
+    std::string line;
+    for (int index = 0; index < 2; ++index) {
+        SendToPlayer(*players[index], "ucinewgame");
+        SendToPlayer(*players[index], "isready");
+        if (!WaitForPlayer(*players[index], "readyok", line)) return index == 0 ? 0 : 2;
+    }
+    
+    ParseFen(fen);
+    int white = (board.side == WHITE) ? 0 : 1;
+    long long clocks[2] = {options.baseTime, options.baseTime};
+    std::string moves;
+    
+    for (int plies = 0, mover = 0; ; ++plies, mover ^= 1) {
+        std::string state = BoardGameState();
+        if (state == "draw" || plies >= options.maxPlies) return 1;
+        if (state != "ongoing") return mover == 0 ? 0 : 2;
+        
+        MatchPlayer& player = *players[mover];
+        SendToPlayer(player, "position fen " + fen + (moves.empty() ? "" : " moves" + moves));
+        if (options.nodes > 0) {
+            SendToPlayer(player, "go nodes " + std::to_string(options.nodes));
+        } else {
+            SendToPlayer(player, "go wtime " + std::to_string(clocks[white]) + " btime " + std::to_string(clocks[white ^ 1]) +
+                                 " winc " + std::to_string(options.increment) + " binc " + std::to_string(options.increment));
+        }
+        
+        // An engine that overruns its clock is told to stop, and then loses on time
+        std::mutex watchMutex;
+        std::condition_variable watchDone;
+        int done = false;
+        std::thread watchdog;
+        if (options.nodes <= 0) {
+            long long limit = clocks[mover] + MATCH_GRACE_MS;
+            watchdog = std::thread([&player, &watchMutex, &watchDone, &done, limit]() {
+                std::unique_lock<std::mutex> lock(watchMutex);
+                if (!watchDone.wait_for(lock, std::chrono::milliseconds(limit), [&done]() { return done; })) {
+                    SendToPlayer(player, "stop");
+                }
+            });
+        }
+        
+        long long start = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+        int answered = WaitForPlayer(player, "bestmove", line);
+        if (watchdog.joinable()) {
+            {
+                std::lock_guard<std::mutex> lock(watchMutex);
+                done = true;
+            }
+            watchDone.notify_one();
+            watchdog.join();
+        }
+        long long elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count() - start;
+        
+        // Crashes, time forfeits and illegal moves all lose the game
+        if (options.nodes <= 0) {
+            clocks[mover] -= elapsed;
+            if (clocks[mover] < 0) answered = false;
+            clocks[mover] += options.increment;
+        }
+        std::istringstream iss(line);
+        std::string token;
+        iss >> token >> token;
+        int move = answered ? ParseUciMove(token) : NO_MOVE;
+        if (move == NO_MOVE || !MakeMove(move)) return mover == 0 ? 0 : 2;
+        board.ply = 0;
+        moves += " " + token;
+    }
+}
+
+double ScoreToElo(double score) {
+    score = std::max(1e-6, std::min(score, 1.0 - 1e-6));
+    return -400.0 * std::log10(1.0 / score - 1.0);
+}
+
+double EloToScore(double elo) {
+    return 1.0 / (1.0 + std::pow(10.0, -elo / 400.0));
+}
+
+// Log-likelihood ratio of elo1 against elo0 for a win/draw/loss record, using the normal approximation of the GSPRT
+double SprtLlr(long long wins, long long draws, long long losses, double elo0, double elo1) {
+    double games = static_cast<double>(wins + draws + losses);
+    if (games == 0) return 0;
+    double score = (wins + draws / 2.0) / games;
+    double variance = (wins * (1 - score) * (1 - score) + draws * (0.5 - score) * (0.5 - score) + losses * score * score) / games;
+    if (variance <= 0) return 0;
+    double score0 = EloToScore(elo0);
+    double score1 = EloToScore(elo1);
+    return (score1 - score0) * (2 * score - score0 - score1) * games / (2 * variance);
+}
+
+std::string FormatMatchStatus(long long wins, long long draws, long long losses, const MatchOptions& options) {
+    double games = static_cast<double>(wins + draws + losses);
+    double score = games > 0 ? (wins + draws / 2.0) / games : 0.5;
+    double variance = games > 0 ? (wins * (1 - score) * (1 - score) + draws * (0.5 - score) * (0.5 - score) + losses * score * score) / games : 0;
+    double margin = games > 0 ? 1.96 * std::sqrt(variance / games) : 0;
+    
+    char text[256];
+    snprintf(text, sizeof(text), "games %lld wins %lld draws %lld losses %lld elo %.1f +- %.1f llr %.2f bounds [%.2f, %.2f]",
+             wins + draws + losses, wins, draws, losses, ScoreToElo(score),
+             (ScoreToElo(score + margin) - ScoreToElo(score - margin)) / 2, SprtLlr(wins, draws, losses, options.elo0, options.elo1),
+             std::log(options.beta / (1 - options.alpha)), std::log((1 - options.beta) / options.alpha));
+    return text;
+}
+
+// Plays engine 1 against engine 2 on every core. Each opening is played twice with colours reversed, and the
+// match stops early once the SPRT accepts either hypothesis.
+int RunMatch(int argc, char* argv[]) {
+    MatchOptions options = {{"", ""}, {{}, {}}, "", 1000, static_cast<int>(std::thread::hardware_concurrency()),
+                            10000, 100, 0, 400, 0, 5, 0.05, 0.05};
+    
+    for (int i = 2; i + 1 < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--engine1") options.engines[0] = argv[++i];
+        else if (arg == "--engine2") options.engines[1] = argv[++i];
+        else if (arg == "--option1") options.options[0].push_back(argv[++i]);
+        else if (arg == "--option2") options.options[1].push_back(argv[++i]);
+        else if (arg == "--openings") options.openings = argv[++i];
+        else if (arg == "--games") options.games = std::atoi(argv[++i]);
+        else if (arg == "--concurrency") options.concurrency = std::atoi(argv[++i]);
+        else if (arg == "--nodes") options.nodes = std::atoll(argv[++i]);
+        else if (arg == "--maxplies") options.maxPlies = std::atoi(argv[++i]);
+        else if (arg == "--elo0") options.elo0 = std::atof(argv[++i]);
+        else if (arg == "--elo1") options.elo1 = std::atof(argv[++i]);
+        else if (arg == "--alpha") options.alpha = std::atof(argv[++i]);
+        else if (arg == "--beta") options.beta = std::atof(argv[++i]);
+        else if (arg == "--tc") {
+            std::string tc = argv[++i];
+            size_t plus = tc.find('+');
+            options.baseTime = static_cast<long long>(std::atof(tc.substr(0, plus).c_str()) * 1000);
+            options.increment = plus != std::string::npos ? static_cast<long long>(std::atof(tc.substr(plus + 1).c_str()) * 1000) : 0;
+        }
+    }
+    
+    if (argc < 3) {
+        std::cerr << "Usage: slowfish match [--engine1 cmd] [--engine2 cmd] [--option1 name=value] [--option2 name=value] "
+                     "[--openings file.epd] [--games N] [--concurrency K] [--tc seconds+increment] [--nodes N] [--maxplies N] "
+                     "[--elo0 E] [--elo1 E] [--alpha A] [--beta B]" << std::endl;
+        return 1;
+    }
+    
+    std::vector<std::string> openings;
+    if (!options.openings.empty()) {
+        MappedFile file;
+        if (!MapFile(options.openings, file)) {
+            std::cerr << "Error: Cannot open openings file: " << options.openings << std::endl;
+            return 1;
+        }
+        ForEachLineInChunk(file, 0, file.size, [&](const char* line, size_t length) {
+            std::string fen;
+            std::string operations;
+            if (SplitEpdLine(line, length, fen, operations)) openings.push_back(fen);
+        });
+        UnmapFile(file);
+    }
+    if (openings.empty()) openings.push_back("rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1");
+    
+#ifndef _WIN32
+    signal(SIGPIPE, SIG_IGN);
+#endif
+    options.concurrency = std::max(1, std::min(options.concurrency, options.games));
+    std::vector<std::unique_ptr<MatchPlayer>> players;
+    for (int i = 0; i < 2 * options.concurrency; ++i) {
+        players.emplace_back(new MatchPlayer());
+        if (!StartPlayer(*players.back(), options.engines[i % 2], options.options[i % 2])) {
+            std::cerr << "Error: Cannot start engine " << (i % 2 + 1) << std::endl;
+            for (std::unique_ptr<MatchPlayer>& player : players) StopPlayer(*player);
+            return 1;
+        }
+    }
+    
+    std::mutex matchMutex;
+    std::atomic<int> nextGame(0);
+    std::atomic<int> finished(false);
+    long long wins = 0;
+    long long draws = 0;
+    long long losses = 0;
+    double lowerBound = std::log(options.beta / (1 - options.alpha));
+    double upperBound = std::log((1 - options.beta) / options.alpha);
+    long long lastReport = 0;
+    
+    auto worker = [&](int slot) {
+        for (int game = nextGame++; game < options.games && !finished; game = nextGame++) {
+            MatchPlayer* first = players[2 * slot + game % 2].get();
+            MatchPlayer* second = players[2 * slot + (game + 1) % 2].get();
+            MatchPlayer* order[2] = {first, second};
+            int result = PlayMatchGame(order, openings[(game / 2) % openings.size()], options);
+            if (game % 2 == 1) result = 2 - result;
+            
+            std::lock_guard<std::mutex> lock(matchMutex);
+            (result == 2 ? wins : result == 1 ? draws : losses)++;
+            double llr = SprtLlr(wins, draws, losses, options.elo0, options.elo1);
+            if (llr <= lowerBound || llr >= upperBound) finished = true;
+            
+            long long now = std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+            if (now - lastReport >= 1000) {
+                lastReport = now;
+                std::cerr << "info string match " << FormatMatchStatus(wins, draws, losses, options) << std::endl;
+            }
+        }
+    };
+    
+    std::vector<std::thread> threads;
+    for (int slot = 0; slot < options.concurrency; ++slot) {
+        threads.emplace_back(worker, slot);
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    for (std::unique_ptr<MatchPlayer>& player : players) {
+        StopPlayer(*player);
+    }
+    
+    double llr = SprtLlr(wins, draws, losses, options.elo0, options.elo1);
+    std::cout << "info string match " << FormatMatchStatus(wins, draws, losses, options) << std::endl;
+    std::cout << "info string sprt " << (llr >= upperBound ? "H1 accepted" : llr <= lowerBound ? "H0 accepted" : "inconclusive")
+              << " elo0 " << options.elo0 << " elo1 " << options.elo1 << std::endl;
+    return 0;
+}
+
+#ifndef SLOWFISH_LIBRARY
+int main(int argc, char* argv[]) {
+    std::call_once(initFlag, init);
+    
+    if (argc > 1 && std::string(argv[1]) == "analyze") {
+        return RunAnalyze(argc, argv);
+    }
+    if (argc > 1 && std::string(argv[1]) == "classify") {
+        return RunClassify(argc, argv);
+    }
+    if (argc > 1 && std::string(argv[1]) == "cache") {
+        return RunCacheTool(argc, argv);
+    }
+    if (argc > 1 && std::string(argv[1]) == "trace") {
+        return RunTraceTool(argc, argv);
+    }
+    if (argc > 1 && std::string(argv[1]) == "worker") {
+        return RunWorker(argc, argv);
+    }
+    if (argc > 1 && std::string(argv[1]) == "server") {
+        return RunServer(argc, argv);
+    }
+    if (argc > 1 && std::string(argv[1]) == "cluster") {
+        return RunCluster(argc, argv);
+    }
+    if (argc > 1 && std::string(argv[1]) == "match") {
+        return RunMatch(argc, argv);
+    }
+    if (argc > 1 && std::string(argv[1]) == "tune") {
+        return RunTune(argc, argv);
+    }
+    if (argc > 1 && std::string(argv[1]) == "datagen") {
+        return RunDatagen(argc, argv);
+    }
+    if (argc > 1 && std::string(argv[1]) == "pgn") {
+        return RunPgn(argc, argv);
+    }
+    
+    UciLoop();
+    return 0;
+}
+#endif
@@ -0,0 +1,69 @@
+#ifndef SLOWFISH_H
+#define SLOWFISH_H
+
+#include <functional>
+#include <string>
+#include <vector>
+
+struct SearchLimits {
+    int depth = 0;            // 0 searches to the maximum depth
+    long long movetime = -1;  // Milliseconds, -1 for no time limit
+    long long nodes = 0;      // 0 for no node limit
+    int multiPv = 1;          // Number of best root moves to report
+    std::vector<std::string> searchMoves;  // Restricts the search to these root moves (UCI notation), empty for all
+};
+
+struct SearchInfo {
+    int depth = 0;
+    int seldepth = 0;
+    int multipv = 1;          // 1 for the best line, 2 for the second best and so on
+    int score = 0;            // Centipawns from the side to move's point of view
+    int mate = 0;             // Moves until mate (negative when getting mated), 0 if the score is not a mate score
+    long long nodes = 0;
+    long long time = 0;       // Milliseconds since the search started
+    int hashfull = 0;
+    std::vector<std::string> pv;
+};
+
+struct SearchResult {
+    std::string bestMove;
+    SearchInfo info;
+    std::vector<SearchInfo> lines;  // Every MultiPV line from the last iteration, best first
+};
+
+// An independent engine instance. Each instance owns its own board, search state and hash table and
+// runs its work on a dedicated thread, so several instances can search concurrently in one process.
+class Engine {
+public:
+    Engine();
+    ~Engine();
+    Engine(const Engine&) = delete;
+    Engine& operator=(const Engine&) = delete;
+
+    // Searches the FEN position and blocks until the search finishes. The callback gets every line of every completed iteration.
+    SearchResult search(const std::string& fen, const SearchLimits& limits,
+                        const std::function<void(const SearchInfo&)>& callback = nullptr);
+
+    // Returns "win" (white is checkmated), "loss" (black is checkmated), "draw" or "ongoing", like getGameState
+    std::string gameState(const std::string& fen);
+
+    // Returns the legal moves of the FEN position in UCI notation
+    std::vector<std::string> legalMoves(const std::string& fen);
+
+    // Queues a UCI command for this instance and returns immediately. Output lines are passed to the callback.
+    // "stop" and "isready" are answered straight away, even while a search is running.
+    void uci(const std::string& command, const std::function<void(const std::string&)>& output);
+
+    // Stops the running search and any search queued before this call
+    void stop();
+
+private:
+    struct Worker;
+    Worker* worker;
+};
+
+// Labels many positions across threads (0 uses every core), with the same labels as Engine::gameState
+// plus "invalid" for positions that cannot be parsed
+std::vector<std::string> classifyGameStates(const std::vector<std::string>& fens, int threads = 0);
+
+#endif